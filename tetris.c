@@ -10,162 +10,219 @@
 #include <time.h>
 #include <string.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
 
 #ifdef _WIN32
 #include <windows.h>
 #include <conio.h>
+#include <io.h>
+#include <malloc.h>
 #else
 #include <unistd.h>
 #include <termios.h>
 #include <fcntl.h> 
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
 #endif
 
+/* Default board size, others can be picked at startup up to the maximums */
 #define BOARD_WIDTH 20
 #define BOARD_HEIGHT 21
+#define BOARD_MAX_WIDTH 64   // Every row has to fit in one BoardRow
+#define BOARD_MAX_HEIGHT 128
+#define BOARD_MIN_SIZE 4
 
 typedef enum {
     I, J, L, O, S, T, Z, INV_L
 } Tetromino;
 
-const char *TETRIS_COLORS[] = {
-    "\x1b[47m", // 0
-    "\x1b[41m", // 1
-    "\x1b[42m", // 2
-    "\x1b[43m", // 3
-    "\x1b[44m", // 4
-    "\x1b[45m", // 5
-    "\x1b[46m", // 6
-    "\x1b[42m", // 7
-    "\e[0;100m", // 8  
-    "\x1b[0m"   // 9
-};
-
 const int GHOST_COLOR_INDEX = 8;
-
-const char *TETROMINO_SHAPES[][4] = {
-    {"...."
-     "####"
-     "...."
-     "....",
-     "..#."
-     "..#."
-     "..#."
-     "..#."},
-    {"...."
-     ".###"
-     "..#."
-     "....",
-     "..#."
-     ".##."
-     "..#."
-     "....",
-     "...."
-     ".#.."
-     "###."
-     "....",
-     ".#.."
-     "##.."
-     ".#.."
-     "...."},
-    {"...."
-     "###."
-     "#..."
-     "....",
-     "#..."
-     "#..."
-     "##.."
-     "....",
-     "#..."
-     "###."
-     "...."
-     "....",
-     ".##."
-     "..#."
-     "..#."
-     "...."},
-    {"...."
-     "##.."
-     "##.."},
-    {"...."
-     ".##."
-     "##.."
-     "....",
-     "...."
-     ".#.."
-     ".##."
-     "..#."},
-    {"...."
-     "##.."
-     ".##."
-     "....",
-     "...."
-     "..#."
-     ".##."
-     ".#.."},
-    {"...."
-     "###."
-     "#..."
-     "....",
-     "#..."
-     "##.."
-     "#..."
-     "....",
-     "...."
-     "#..."
-     "###."
-     "....",
-     ".#.."
-     ".##."
-     ".#.."
-     "...."},
-    {"...."
-     "###."
-     "..#."
-     "....",
-     ".#.."
-     ".#.."
-     "##.."
-     "....",
-     "...."
-     ".#.."
-     "###."
-     "....",
-     "##.."
-     "#..."
-     "#..."
-     "...."}};
-
-const char *INVERTED_L_SHAPES[] = {
-    "...."
-    "...."
-    "###."
-    "..#.",
-
-    "...."
-    "..#."
-    ".##."
-    "..#.",
-
-    "...."
-    "...."
-    ".#.."
-    "###.",
-
-    "...."
-    ".#.."
-    "##.."
-    ".#.."};
+const int GARBAGE_COLOR_INDEX = 8; // Garbage rows share the ghost's gray
 
 typedef struct {
     int x, y;
 } Point;
 
+/*
+  Cells of every piece in every rotation, relative to the piece origin.
+  Rotation r + 1 is rotation r turned clockwise around the piece's pivot cell,
+  so O simply repeats itself and every piece has four entries.
+*/
+const Point PIECE_CELLS[8][4][4] = {
+    {{{0, 1}, {1, 1}, {2, 1}, {3, 1}},
+     {{1, 0}, {1, 1}, {1, 2}, {1, 3}},
+     {{2, 1}, {1, 1}, {0, 1}, {-1, 1}},
+     {{1, 2}, {1, 1}, {1, 0}, {1, -1}}}, // I
+    {{{1, 1}, {2, 1}, {3, 1}, {2, 2}},
+     {{2, 0}, {2, 1}, {2, 2}, {1, 1}},
+     {{3, 1}, {2, 1}, {1, 1}, {2, 0}},
+     {{2, 2}, {2, 1}, {2, 0}, {3, 1}}}, // J
+    {{{0, 1}, {1, 1}, {2, 1}, {0, 2}},
+     {{1, 0}, {1, 1}, {1, 2}, {0, 0}},
+     {{2, 1}, {1, 1}, {0, 1}, {2, 0}},
+     {{1, 2}, {1, 1}, {1, 0}, {2, 2}}}, // L
+    {{{0, 1}, {1, 1}, {0, 2}, {1, 2}},
+     {{0, 1}, {1, 1}, {0, 2}, {1, 2}},
+     {{0, 1}, {1, 1}, {0, 2}, {1, 2}},
+     {{0, 1}, {1, 1}, {0, 2}, {1, 2}}}, // O
+    {{{1, 1}, {2, 1}, {0, 2}, {1, 2}},
+     {{1, 1}, {1, 2}, {0, 0}, {0, 1}},
+     {{1, 1}, {0, 1}, {2, 0}, {1, 0}},
+     {{1, 1}, {1, 0}, {2, 2}, {2, 1}}}, // S
+    {{{0, 1}, {1, 1}, {1, 2}, {2, 2}},
+     {{1, 0}, {1, 1}, {0, 1}, {0, 2}},
+     {{2, 1}, {1, 1}, {1, 0}, {0, 0}},
+     {{1, 2}, {1, 1}, {2, 1}, {2, 0}}}, // T
+    {{{0, 1}, {1, 1}, {2, 1}, {0, 2}},
+     {{0, 1}, {0, 2}, {0, 3}, {-1, 1}},
+     {{0, 1}, {-1, 1}, {-2, 1}, {0, 0}},
+     {{0, 1}, {0, 0}, {0, -1}, {1, 1}}}, // Z
+    {{{0, 2}, {1, 2}, {2, 2}, {2, 3}},
+     {{2, 0}, {2, 1}, {2, 2}, {1, 2}},
+     {{4, 2}, {3, 2}, {2, 2}, {2, 1}},
+     {{2, 4}, {2, 3}, {2, 2}, {3, 2}}} // INV_L
+};
+
+/* Bounding box of one piece rotation as row masks, bit 0 is the leftmost column */
+typedef struct {
+    int left, top;      // Offset of the bounding box from the piece origin
+    int width, height;
+    uint8_t rows[4];
+} PieceMask;
+
+/* The same rotations as PIECE_CELLS, packed for collision tests against the bitboard */
+const PieceMask PIECE_MASKS[8][4] = {
+    {{0, 1, 4, 1, {0xf, 0x0, 0x0, 0x0}},
+     {1, 0, 1, 4, {0x1, 0x1, 0x1, 0x1}},
+     {-1, 1, 4, 1, {0xf, 0x0, 0x0, 0x0}},
+     {1, -1, 1, 4, {0x1, 0x1, 0x1, 0x1}}}, // I
+    {{1, 1, 3, 2, {0x7, 0x2, 0x0, 0x0}},
+     {1, 0, 2, 3, {0x2, 0x3, 0x2, 0x0}},
+     {1, 0, 3, 2, {0x2, 0x7, 0x0, 0x0}},
+     {2, 0, 2, 3, {0x1, 0x3, 0x1, 0x0}}}, // J
+    {{0, 1, 3, 2, {0x7, 0x1, 0x0, 0x0}},
+     {0, 0, 2, 3, {0x3, 0x2, 0x2, 0x0}},
+     {0, 0, 3, 2, {0x4, 0x7, 0x0, 0x0}},
+     {1, 0, 2, 3, {0x1, 0x1, 0x3, 0x0}}}, // L
+    {{0, 1, 2, 2, {0x3, 0x3, 0x0, 0x0}},
+     {0, 1, 2, 2, {0x3, 0x3, 0x0, 0x0}},
+     {0, 1, 2, 2, {0x3, 0x3, 0x0, 0x0}},
+     {0, 1, 2, 2, {0x3, 0x3, 0x0, 0x0}}}, // O
+    {{0, 1, 3, 2, {0x6, 0x3, 0x0, 0x0}},
+     {0, 0, 2, 3, {0x1, 0x3, 0x2, 0x0}},
+     {0, 0, 3, 2, {0x6, 0x3, 0x0, 0x0}},
+     {1, 0, 2, 3, {0x1, 0x3, 0x2, 0x0}}}, // S
+    {{0, 1, 3, 2, {0x3, 0x6, 0x0, 0x0}},
+     {0, 0, 2, 3, {0x2, 0x3, 0x1, 0x0}},
+     {0, 0, 3, 2, {0x3, 0x6, 0x0, 0x0}},
+     {1, 0, 2, 3, {0x2, 0x3, 0x1, 0x0}}}, // T
+    {{0, 1, 3, 2, {0x7, 0x1, 0x0, 0x0}},
+     {-1, 1, 2, 3, {0x3, 0x2, 0x2, 0x0}},
+     {-2, 0, 3, 2, {0x4, 0x7, 0x0, 0x0}},
+     {0, -1, 2, 3, {0x1, 0x1, 0x3, 0x0}}}, // Z
+    {{0, 2, 3, 2, {0x7, 0x4, 0x0, 0x0}},
+     {1, 0, 2, 3, {0x2, 0x2, 0x3, 0x0}},
+     {2, 1, 3, 2, {0x1, 0x7, 0x0, 0x0}},
+     {2, 2, 2, 3, {0x3, 0x1, 0x1, 0x0}}} // INV_L
+};
+
+/* The game logic runs at a fixed rate, whatever the frame rate */
+#define TICK_RATE 60
+#define TICK_NANOS (1000000000ull / TICK_RATE)
+#define MAX_CATCHUP_TICKS TICK_RATE  // After a stall, skip time rather than fast forward through it
+
+#define LOCK_DELAY_TICKS 30  // A landed piece can still move for half a second
+#define LOCK_RESETS 15       // Moves that restart the lock delay, so a piece can't stall forever
+
+/* Auto-repeat of a held shift key */
+#define REPEAT_GAP_TICKS 6   // Two presses closer than this mean the terminal is repeating a held key
+#define ARR_TICKS 2          // Ticks between automatic shifts
+
+/* Rows gravity pulls per tick at each level, 16.16 fixed point. This is the
+   guideline curve of (0.8 - (level - 1) * 0.007) ^ (level - 1) seconds per
+   row, up to 20 rows a tick from level 19 on. */
+const uint32_t GRAVITY[19] = {
+    1092, 1377, 1768, 2311, 3075, 4169, 5759, 8107, 11634, 17026,
+    25416, 38709, 60169, 95483, 154742, 256187, 433425, 749597, 20 << 16
+};
+
+/* Turns wall clock time into whole logic ticks and carries the rest over */
+typedef struct {
+    uint64_t last;         // Nanoseconds when ticks were last taken, 0 before the first
+    uint64_t accumulator;  // Time not yet spent on a tick
+} GameClock;
+
+/* Garbage rows an opponent sent, all full but for one hole column */
+typedef struct {
+    uint8_t rows;
+    uint8_t hole;
+} Garbage;
+
+#define GARBAGE_QUEUE_MAX 16
+
+/* How a game deals its pieces */
+typedef enum {
+    RANDOMIZER_UNIFORM,  // Every piece equally likely every time
+    RANDOMIZER_BAG7,     // The seven standard pieces shuffled, one of each per bag
+    RANDOMIZER_BAG8,     // The same with INV_L in the bag too
+    RANDOMIZER_HISTORY   // Rerolls a piece that was among the last few, a few times at most
+} RandomizerPolicy;
+
+const char *RANDOMIZER_NAMES[] = {"uniform", "bag7", "bag8", "history"};
+
+#define PREVIEW_MAX 5       // Upcoming pieces the sidebar can show
+#define HISTORY_LENGTH 4
+#define HISTORY_ROLLS 4
+
+/* PCG32, each game owns one so nothing is shared between threads */
 typedef struct {
-    char board[BOARD_HEIGHT][BOARD_WIDTH];
+    uint64_t state;
+    uint64_t increment;  // Picks the stream, always odd
+} Rng;
+
+/*
+  Deals one game's pieces. The upcoming ones wait in a ring as deep as the
+  preview, and everything is inline so dealing never allocates.
+*/
+typedef struct {
+    Rng rng;
+    RandomizerPolicy policy;
+    Tetromino bag[8];                  // Pieces still to come from the current bag
+    int bagLeft;
+    Tetromino history[HISTORY_LENGTH]; // Most recent first
+    Tetromino preview[PREVIEW_MAX];    // Ring of the pieces after the current one
+    int previewStart, previewDepth;
+} Randomizer;
+
+/*
+  One bit per column, bit x set when column x of the row is occupied. A row
+  of any supported width is a single machine word, so collision, line tests
+  and line shifts cost the same whatever the board size.
+*/
+typedef uint64_t BoardRow;
+
+typedef struct {
+    int width, height;
+    BoardRow fullRow;                                    // Mask of a completely filled row
+    BoardRow rows[BOARD_MAX_HEIGHT];                     // Occupancy bitboard
+    uint8_t colors[BOARD_MAX_HEIGHT][BOARD_MAX_WIDTH];   // Piece color of each occupied cell
+    uint8_t columnHeights[BOARD_MAX_WIDTH];              // Rows from the floor to each column's top block
+    int holes;                                           // Empty cells with a block above them
+    int lockTop, lockBottom;                             // Rows the last locked piece landed in
     Tetromino currentTetromino;
-    Tetromino nextTetromino;
-    Point currentPositions[4];
+    Point currentPositions[4];  // Board cells of the falling piece
+    Point position;             // Origin of the falling piece on the board
     int rotation;
     bool gameOver;
     int score;
@@ -175,29 +232,570 @@ typedef struct {
     bool showGhost;
     bool toggleColors;
     bool showDots;  
+    bool showFrameStats;
+    bool halfBlock; // Two board rows to each terminal row
+    int ghostDrop;  // Rows the current piece can still fall, -1 if it doesn't fit
+    Randomizer randomizer;  // Deals the pieces, see spawnTetromino()
+    uint64_t seed;          // The game was started from this, kept for the score log
+    int garbageSent;        // Garbage rows this game's line clears have sent, for versus play
+    Garbage incoming[GARBAGE_QUEUE_MAX]; // Garbage waiting to rise when the next piece locks, not saved
+    int incomingCount;
+    uint64_t tick;          // Logic ticks the game has run for
+    uint32_t gravityFraction; // Progress toward the next row, 16.16 fixed point
+    uint32_t lockTimer;     // Ticks the piece has rested on the stack
+    int lockResets;         // Moves that restarted the lock delay for this piece
+    int lowestY;            // Lowest row the piece has reached
+    long pieces;            // Pieces locked so far
+    uint32_t revision;      // Bumped whenever something on screen changes
+    GameClock clock;        // Interactive play only
 } Tetris;
 
+#define BATCH_MAX_THREADS 1024
+
+/* Command line settings */
+typedef struct {
+    bool headless;
+    bool seedGiven;
+    uint64_t seed;
+    const char *inputsPath;
+    long maxPieces;  // Stop a headless game after this many pieces, -1 for no limit
+    long batchGames; // Games to simulate in batch mode, 0 when not batching
+    int threads;     // Batch worker threads, 0 for one per core
+    bool bench;
+    const char *benchFilter;  // Only run benchmarks whose name contains this
+    long checkGames;          // Random games to check the engine's invariants on, 0 when not checking
+    const char *fuzzPath;     // Check the game this fuzzer input describes
+    const char *tracePath;    // Write per-frame timings here on exit
+    int width, height;        // Board size
+    const char *recordPath;   // Record the game's keys to this replay file
+    const char *replayPath;   // Play this replay instead of a live game
+    long seekPiece;           // Start playback once this many pieces have locked
+    bool bot;                 // Let the placement search play
+    int botDepth;             // Pieces the bot looks ahead
+    int botThreads;           // Threads the bot splits its first placements over
+    RandomizerPolicy randomizer;
+    int preview;              // Upcoming pieces shown
+    bool stats;               // Print the score log and exit
+    bool halfBlock;           // Start with two board rows to a terminal row
+    const char *themePath;    // Colors to draw with, instead of ~/.tetris.theme
+    int colorDepth;           // A ColorDepth, or -1 to go by the environment
+    const char *versusListen;  // Wait for a versus opponent on this port or socket path
+    const char *versusConnect; // Join a versus game at this host:port or socket path
+    const char *spectateServe; // Let viewers watch the live game on this port or socket path
+    const char *spectate;      // Watch a game served at this host:port or socket path
+    bool newGame;             // Don't pick up the saved game
+    const char *loadPath;     // Start from this snapshot
+    const char *savePath;     // Save slot, instead of ~/.tetris.sav
+} Options;
+
+#define SNAPSHOT_MAGIC "TTSV"
+#define SNAPSHOT_VERSION 3
+/* Header, counters and randomizer with room to spare, plus five bit-planes of a full board */
+#define SNAPSHOT_MAX_SIZE (256 + 5 * BOARD_MAX_HEIGHT * (BOARD_MAX_WIDTH / 8))
+
+/*
+  One finished game in the score log. Records are fixed size and appended
+  whole, so a torn write can only ever damage the last one, and the
+  checksum catches it. Compaction folds the games that fall off the table
+  into a single summary record, whose games count is above one and whose
+  score is the sum, so the totals survive it.
+*/
+typedef struct {
+    uint32_t magic;           // SCORE_MAGIC
+    uint32_t checksum;        // FNV-1a of everything after it
+    uint64_t seed;
+    int64_t endedAt;          // Unix time, the last game's for a summary
+    uint64_t durationMillis;  // Game time, pauses don't count
+    uint64_t score;
+    uint32_t level;
+    uint32_t lines;
+    uint32_t pieces;
+    uint32_t games;           // 1 for a game, more for a summary
+    uint16_t width, height;
+    uint32_t reserved;
+} ScoreRecord;
+
+_Static_assert(sizeof(ScoreRecord) == 64, "score records are written as they are laid out");
+
+#define SCORE_MAGIC 0x31535454u     // "TTS1" in a little-endian file
+#define SCORE_TABLE_SIZE 100        // Games kept one by one when the log is compacted
+#define SCORE_COMPACT_RECORDS 1024  // Compact once the log reaches this many records
+#define SCORE_SHOWN 5               // Best games on the game over screen
+
+/* Reads a snapshot back, every read past the end fails the whole load */
+typedef struct {
+    const uint8_t *data;
+    size_t length, position;
+    bool failed;
+} SnapshotReader;
+
+/* One recorded key press and the tick it was applied on */
+typedef struct {
+    uint64_t tick;
+    uint8_t key;
+} ReplayEvent;
+
+/* A snapshot of the game during playback, so seeking back doesn't start over */
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    long pieces;
+    size_t nextEvent;
+} ReplaySnapshot;
+
+#define REPLAY_MAGIC "TTRP"
+#define REPLAY_VERSION 3
+#define REPLAY_HEADER_SIZE 16
+#define REPLAY_END_KEY 0            // Marks the tick the recording stopped on
+#define REPLAY_SNAPSHOT_PIECES 10   // Pieces between two seek points
+
+/*
+  A replay is the seed, the board size and every key with the tick it was
+  pressed on. The game is deterministic, so that is all it takes to play it
+  again exactly.
+*/
+typedef struct {
+    uint64_t seed;
+    int width, height;
+    RandomizerPolicy policy;
+    int previewDepth;
+    ReplayEvent *events;
+    size_t eventCount, eventCapacity;
+    uint64_t endTick;               // The recording stopped here, UINT64_MAX if it didn't say
+    size_t nextEvent;               // Playback position
+    ReplaySnapshot *snapshots;      // snapshots[n] is the game after n * REPLAY_SNAPSHOT_PIECES pieces
+    size_t snapshotCount, snapshotCapacity;
+    const char *path;               // Recording only, where to write it
+    const Tetris *game;             // Recording only, the game being recorded
+} Replay;
+
+static Replay recording;
+
+/* Messages are a type byte and a 16 bit length, then the payload */
+#define INBOX_SIZE (3 + 65535)
+
+/* Bytes read from a socket until they make up whole messages */
+typedef struct {
+    int fd;
+    uint8_t data[INBOX_SIZE];
+    size_t length;
+    bool closed;        // Hung up, or can't be followed any more
+} Inbox;
+
+/* One entry of a versus peer's stream: a key it pressed, or garbage it took into its queue */
+typedef struct {
+    uint64_t tick;
+    uint8_t key;        // VERSUS_GARBAGE for garbage
+    uint8_t rows, hole;
+} VersusEvent;
+
+#define VERSUS_MAGIC "TTVS"
+#define VERSUS_VERSION 1
+#define VERSUS_HELLO 1              // Message with the game settings, from the listening peer
+#define VERSUS_BATCH 2              // Message with the tick a peer has played to and its events since the last one
+#define VERSUS_GARBAGE 0            // Event code for garbage, no key is 0
+#define VERSUS_HEARTBEAT_TICKS 6    // Confirm progress at least this often when nothing happens
+#define VERSUS_PREDICT_TICKS 30     // Run the opponent on without input for at most this long
+#define VERSUS_BATCH_EVENTS 64       // Events in one batch message at most
+
+/*
+  Versus play. Each peer runs its own game and streams every key it applies
+  and every garbage batch it takes in, with the tick, in one batch per tick
+  at most. The game is deterministic, so the other peer replays that stream
+  on its own copy of the opponent, which runs as far as the opponent has
+  confirmed. For display that copy is run on a little further, assuming no
+  keys, and the guess is thrown away and redone from the confirmed state
+  every frame, so latency never stalls either player and nothing needs to
+  be undone in the real games.
+  Garbage is decided by the opponent's copy: when its clears send rows, the
+  receiving peer queues them into its own game and puts that in its stream.
+*/
+typedef struct {
+    Inbox peer;
+    Tetris *game;                    // Ours, NULL when not in a versus game
+    Tetris opponent;                 // Their game, as of remoteTick
+    VersusEvent *outgoing;           // Events not sent yet
+    size_t outgoingCount, outgoingCapacity;
+    uint64_t sentTick;               // Tick the last batch confirmed
+    uint64_t outgoingEventTick;      // Ticks in the stream are deltas from the previous event
+    VersusEvent *events;             // Their events not applied yet
+    size_t eventCount, nextEvent, eventCapacity;
+    uint64_t incomingEventTick;
+    uint64_t remoteTick;             // They have played up to here
+    uint64_t remoteTickAt;           // Nanoseconds when remoteTick last moved
+    int garbageSeen;                 // Rows of the opponent's garbage already queued to us
+    Rng holes;                       // Picks the hole column of garbage we take in
+} Versus;
+
+static Versus versus;
+
+#define SPECTATE_KEYFRAME 1         // Message with a whole snapshot of the game
+#define SPECTATE_DELTA 2            // Message with what changed since the one before
+#define SPECTATE_MAX_VIEWERS 64
+#define SPECTATE_BUFFER_SIZE 65536  // Bytes a viewer can fall behind by before it misses frames
+#define SPECTATE_FRAME_MAX (64 + PREVIEW_MAX + 3 * BOARD_MAX_WIDTH * BOARD_MAX_HEIGHT)
+
+/* A connected viewer and what its socket hasn't taken yet */
+typedef struct {
+    int fd;
+    uint8_t pending[SPECTATE_BUFFER_SIZE];
+    size_t pendingLength;
+    bool needsKeyframe;     // Missed a delta, or just joined, so the next frame has to be whole
+} Viewer;
+
+/*
+  Publishes the live game to any number of viewers. Each frame is encoded
+  once and queued to every viewer, and the sockets are only ever written
+  when they have room, from the same poll the game sleeps in. A viewer too
+  slow to keep up has frames dropped instead of holding up the game, and
+  gets a keyframe once it has caught up.
+*/
+typedef struct {
+    int listenFd;                       // -1 when not serving
+    const char *path;                   // Unix socket to remove at exit
+    const Tetris *game;
+    Viewer *viewers[SPECTATE_MAX_VIEWERS];
+    int viewerCount;
+    BoardRow rows[BOARD_MAX_HEIGHT];    // The board as the last frame left it
+    uint8_t colors[BOARD_MAX_HEIGHT][BOARD_MAX_WIDTH];
+} Spectate;
+
+#ifndef _WIN32
+static Spectate spectate = {.listenFd = -1};
+#endif
+
+/* Kicks tried in turn when a rotation doesn't fit where the piece is */
+const int ROTATION_KICKS[5] = {0, 1, -1, 2, -2};
+
+/* Occupancy of a board as the bot searches it, far cheaper to copy than a Tetris */
+typedef struct {
+    int width, height;
+    BoardRow fullRow;
+    BoardRow rows[BOARD_MAX_HEIGHT];
+} BotBoard;
+
+/* A placement the bot can reach by turning, shifting and dropping a piece */
+typedef struct {
+    int turns;       // 'w' presses
+    int rotation;
+    int turnedX;     // Origin column once the turns are done
+    int x, y;        // Where the piece locks
+} BotMove;
+
+/* A remembered search result, keyed on a hash of the board */
+typedef struct {
+    uint64_t hash;
+    double value;
+    uint32_t generation;  // Entries from an earlier search are stale
+    int depth;
+} BotCacheEntry;
+
+#define BOT_CACHE_SIZE (1 << 14)
+#define BOT_MAX_DEPTH 3
+#define BOT_BEAM_WIDTH 8    // Placements searched past the first piece, the rest only get a quick look
+#define BOT_MAX_THREADS 16
+#define BOT_KEY_MILLIS 60   // Pace of the bot's keys in a live game
+
+/* What each search thread owns */
+typedef struct {
+    BotCacheEntry cache[BOT_CACHE_SIZE];
+    uint32_t generation;
+} BotSearch;
+
+/*
+  The autoplayer. It searches every reachable placement of the current piece,
+  then of the previewed ones, then averages over all pieces for any deeper
+  levels, and keeps the keys that play the best first placement.
+*/
+typedef struct {
+    int depth;
+    int threads;
+    BotSearch *searches;             // One per thread
+    char keys[BOARD_MAX_WIDTH + 8];  // Turns, shifts and the hard drop
+    int keyCount, nextKey;
+    long plannedPiece;               // Pieces locked when the keys were planned
+    uint64_t nextKeyTime;            // Live games only, when the next key is due
+} Bot;
+
+/* One terminal cell of the retained screen buffers */
+typedef struct {
+    uint32_t ch;    // Unicode code point
+    uint8_t fg, bg; // Palette entries
+} Cell;
+
+/* Colors a frame can use: the eight pieces, the ghost and garbage gray, and the terminal's own */
+#define PALETTE_SIZE 10
+#define PALETTE_ARENA 8192  // Room for every escape sequence a palette interns, even all 24-bit
+#define SGR_MAX 36          // The longest one, "\033[38;2;r;g;b;48;2;r;g;bm" with three digit channels
+
+typedef enum {
+    COLOR_DEPTH_16,     // The terminal's own 16 colors only
+    COLOR_DEPTH_256,    // xterm's 256 color table
+    COLOR_DEPTH_TRUE    // Any 24-bit color
+} ColorDepth;
+
+const char *COLOR_DEPTH_NAMES[] = {"16", "256", "truecolor"};
+
+/* One theme color: an index into the terminal's table, or an exact color */
+typedef struct {
+    bool rgb;
+    uint8_t index;      // 0-15 are the terminal's own colors, 16-255 xterm's 256 color table
+    uint8_t r, g, b;
+} ThemeColor;
+
+/* An escape sequence stored once in the palette's arena */
+typedef struct {
+    uint16_t offset;
+    uint16_t length;
+} Sgr;
+
+/*
+  The theme turned into escape sequences for the terminal's color depth,
+  worked out once at startup: one to set each foreground, each background,
+  and each foreground and background pair, so the renderer only ever copies
+  bytes. Equal sequences are stored once.
+*/
+typedef struct {
+    bool ready;
+    ColorDepth depth;
+    ThemeColor theme[PALETTE_SIZE - 1];
+    Sgr fg[PALETTE_SIZE], bg[PALETTE_SIZE], pair[PALETTE_SIZE][PALETTE_SIZE];
+    char arena[PALETTE_ARENA];
+    size_t arenaLength;
+} Palette;
+
+static Palette palette;
+
+/* The colors the game always had, the terminal's own so they follow its color scheme */
+const uint8_t DEFAULT_THEME[PALETTE_SIZE - 1] = {7, 1, 2, 3, 4, 5, 6, 2, 8};
+const char *THEME_NAMES[PALETTE_SIZE - 1] = {"I", "J", "L", "O", "S", "T", "Z", "INV_L", "ghost"};
+
+#define SCREEN_MAX_COLS 256
+#define SCREEN_MAX_ROWS 96
+#define COLOR_DEFAULT 9
+#define WELL_EMPTY (-1)     // wellColor() of a cell with nothing in it
+#define WELL_GHOST (-2)     // and of one under the ghost piece
+
+/* The game state the back buffer was last composed from */
+typedef struct {
+    int windowCols, windowRows;
+    int width, height;
+    long pieces;                    // Locked cells only change when a piece locks
+    bool toggleColors, showDots, showFrameStats, halfBlock;
+    int score, level, linesCleared;
+    int previewDepth;
+    Tetromino preview[PREVIEW_MAX];
+    Point piece[4];
+    int ghostDrop;                  // -1 when no ghost was drawn
+} DrawnState;
+
+/* 
+  The renderer keeps what is on the terminal (front) and what the next frame
+  should look like (back). Only cells that differ get written out.
+  The back buffer persists between frames: the borders and help text are
+  composed once, and later frames only repaint the parts of the game that
+  changed, so only their rows need comparing.
+*/
+typedef struct {
+    Cell front[SCREEN_MAX_ROWS][SCREEN_MAX_COLS];
+    Cell back[SCREEN_MAX_ROWS][SCREEN_MAX_COLS];
+    bool dirtyRows[SCREEN_MAX_ROWS]; // Back buffer rows written since the last present
+    int cols, rows;         // Terminal size the front buffer was drawn for
+    bool fullRedraw;        // Front buffer no longer matches the terminal
+    bool composed;          // Back buffer holds the game screen described by drawn
+    DrawnState drawn;
+    int boardTop, boardLeft; // Screen cell of the board's top-left border corner
+    size_t frameBytes;      // Bytes written by the frame being presented
+    size_t lastFrameBytes;  // Bytes written by the previous frame
+    uint64_t totalBytes;
+    uint64_t frames;
+} Renderer;
+
+static Renderer renderer = {.fullRedraw = true};
+
+#define FRAME_HISTORY 128
+
+/* Timing of one presented frame */
+typedef struct {
+    uint64_t presentedAt;     // Nanoseconds, monotonic clock
+    uint32_t intervalMicros;  // Since the previous frame was presented
+    uint32_t renderMicros;    // Composing plus writing the frame
+    uint32_t bytes;
+    uint32_t latencyMicros;   // From reading the oldest key in this frame to presenting it, 0 without keys
+} FrameRecord;
+
+/* Rolling frame history for the stats overlay, plus an optional full trace */
+typedef struct {
+    FrameRecord history[FRAME_HISTORY];
+    int count, next;
+    uint64_t frameStart;
+    uint64_t pendingInput;    // When the oldest key not yet on screen was read, 0 if none
+    bool tracing;
+    FrameRecord *trace;
+    size_t traceLength, traceCapacity;
+    const char *tracePath;
+} FrameTimer;
+
+static FrameTimer frameTimer;
+
+/*
+  Big enough for a full repaint of the largest screen buffer in the worst
+  case, where every cell needs a cursor move, a color change in both
+  halves at 24-bit depth and a four byte character.
+*/
+#define FRAME_CELL_MAX (10 + SGR_MAX + 4)
+#define FRAME_BUFFER_SIZE (SCREEN_MAX_ROWS * SCREEN_MAX_COLS * FRAME_CELL_MAX + 64)
+
+/* Output arena a whole frame is assembled in before a single write */
+typedef struct {
+    char data[FRAME_BUFFER_SIZE];
+    size_t length;
+    bool discard;  // Build frames but never send them, for benchmarks
+} FrameBuilder;
+
+static FrameBuilder frame;
+
 void drawPausedScreen();
 void spawnTetromino(Tetris *tetris);
 void draw(const Tetris *tetris);
+void composeBoard(const Tetris *tetris, int top, int left);
+void boardLayout(const Tetris *tetris, int *top, int *left);
+void patchBoard(const Tetris *tetris);
+void rememberDrawn(const Tetris *tetris);
+void drawWellCell(const Tetris *tetris, int x, int y);
+void drawPiece(const Tetris *tetris);
+void drawSidebar(const Tetris *tetris, int top, int side);
+void drawSidebarValues(const Tetris *tetris, int top, int side);
 void drawGhost(const Tetris *tetris);
-void drawNextTetromino(Tetromino tetromino, int row, Tetris *tetris);
+void drawHalfCell(const Tetris *tetris, int x, int y);
+int wellRows(const Tetris *tetris);
+int wellColor(const Tetris *tetris, int x, int y, bool ghost);
+void putHalfCell(int row, int col, int upper, int lower, const Tetris *look);
+void updateGhost(Tetris *tetris);
+void drawNextTetromino(Tetromino tetromino, int row, const Tetris *tetris, int screenRow, int screenCol);
 void input(Tetris *tetris);
-void update(Tetris *tetris);
+int update(Tetris *tetris);
+uint64_t clockTicks(GameClock *clock);
+void clockReset(GameClock *clock);
+int ticksToMillis(const GameClock *clock, uint64_t ticks);
+void autoShift(Tetris *tetris);
+int autoShiftDue(const Tetris *tetris);
+void tetris_init(Tetris *tetris, uint64_t seed, int width, int height, RandomizerPolicy policy, int previewDepth);
+uint32_t tetris_random(Tetris *tetris);
+void rngSeed(Rng *rng, uint64_t seed);
+uint32_t rngNext(Rng *rng);
+uint32_t rngBelow(Rng *rng, uint32_t bound);
+void randomizerInit(Randomizer *randomizer, uint64_t seed, RandomizerPolicy policy, int previewDepth);
+Tetromino randomizerTake(Randomizer *randomizer);
+Tetromino randomizerPeek(const Randomizer *randomizer, int index);
+void tetris_tick(Tetris *tetris);
+void tetris_advance(Tetris *tetris, uint64_t ticks);
+uint32_t gravityPerTick(int level);
+uint64_t ticksUntilEvent(const Tetris *tetris);
+void applyKey(Tetris *tetris, int key);
+void dropPiece(Tetris *tetris);
+bool parseOptions(int argc, char **argv, Options *options);
+int runHeadless(const Options *options);
+int runBatch(const Options *options);
+int runBenchmarks(const Options *options);
+long fuzzGame(const uint8_t *data, size_t size);
+int runFuzzFile(const Options *options);
+int runChecks(const Options *options);
+char *readFile(const char *path, long *length);
+void playInputs(Tetris *tetris, const char *inputs, long length, long maxPieces);
+void playRandom(Tetris *tetris, uint64_t seed, long maxPieces);
+void playGravity(Tetris *tetris, long maxPieces);
+int playReplay(const Options *options);
+int playVersus(const Options *options);
+static void versusEvent(Versus *v, VersusEvent event);
+bool spectateServe(const char *address, const Tetris *tetris);
+void spectatePublish(const Tetris *tetris);
+#ifndef _WIN32
+int spectatePollFds(struct pollfd *fds);
+void spectateService(const struct pollfd *fds, int count);
+#endif
+int playSpectate(const Options *options);
+void composeFrame(const Tetris *tetris);
+bool loadReplay(const char *path, Replay *replay);
+void freeReplay(Replay *replay);
+void replayRun(Replay *replay, Tetris *tetris, uint64_t untilTick, long untilPieces);
+void replaySeek(Replay *replay, Tetris *tetris, long piece);
+Bot *botCreate(int depth, int threads);
+void botFree(Bot *bot);
+void botPlan(Bot *bot, const Tetris *tetris);
+void botInput(Bot *bot, Tetris *tetris);
+void playBot(Tetris *tetris, Bot *bot, long maxPieces);
+void recordKey(const Tetris *tetris, int key);
+void writeReplay();
+size_t saveSnapshot(const Tetris *tetris, uint8_t *data);
+bool loadSnapshot(Tetris *tetris, const uint8_t *data, size_t length);
+bool writeSnapshotFile(const char *path, const Tetris *tetris);
+bool readSnapshotFile(const char *path, Tetris *tetris);
+bool startGame(const Options *options, uint64_t seed, Tetris *tetris);
+const char *defaultSavePath();
+void saveGame(const Tetris *tetris);
+bool writeFileAtomic(const char *path, const void *data, size_t length);
+bool homeFile(const char *name, char *path, size_t size);
+void recordScore(const Tetris *tetris);
+bool appendScore(const char *path, const ScoreRecord *record);
+bool compactScores(const char *path);
+int topScores(const char *path, ScoreRecord *best, int count, ScoreRecord *totals);
+int printStats();
 bool tetris_move(Tetris *tetris, int dx, int dy);
 void rotate(Tetris *tetris);
 bool isValidPosition(const Tetris *tetris, const Point *positions);
+bool pieceFits(const Tetris *tetris, Tetromino piece, int rotation, int x, int y);
+bool rowsFit(const BoardRow *rows, int width, int height, Tetromino piece, int rotation, int x, int y);
+void placePiece(Tetris *tetris, int rotation, int x, int y);
 void lockTetromino(Tetris *tetris);
+void recountBoard(Tetris *tetris);
+void queueGarbage(Tetris *tetris, int rows, int hole);
+void riseGarbage(Tetris *tetris);
 void removeFullLines(Tetris *tetris);
 void drawGameOverScreen(const Tetris *tetris, int score, int level, int linesCleared);
 int _kbhit();
 int _getch();
+bool waitForInput(int timeoutMillis);
+uint64_t getCurrentTimeMillis();
+uint64_t getCurrentTimeNanos();
+void getWindowSize(int *cols, int *rows);
+void beginFrame(int cols, int rows);
+void screenPut(int row, int col, uint32_t ch, uint8_t color);
+void screenPutColors(int row, int col, uint32_t ch, uint8_t fg, uint8_t bg);
+void screenText(int row, int col, const char *fmt, ...);
+void screenClear(int row, int col, int count);
+void presentFrame();
+bool setupPalette(const Options *options);
+void leaveScreen();
+void frameFlush();
+void drawFrameStats(int row, int col);
+void recordFrame();
+void writeFrameTrace();
+
+/* Where the live game is saved when it is quit or interrupted, NULL when it isn't saved */
+static const char *savePath;
+static bool gameSaved;
+static char scorePath[4096];     // Score log of live games, empty when they aren't logged
+static ScoreRecord lastScore;    // The game just logged, to point it out in the table
+static volatile sig_atomic_t interrupted; // SIGINT arrived while a game that gets saved was running
+
+/*
+  Set when the terminal may have changed size, getWindowSize() only asks
+  the terminal again then. SIGWINCH sets it, and on Windows waitForInput()
+  does once the console size differs from the cached one.
+*/
+static volatile sig_atomic_t windowResized = 1;
+static int windowCols, windowRows;
 
 #ifdef _WIN32
 #include <signal.h>
 void sigint_handler(int sig_num) {
     /* Reset handler (optional) */
     signal(SIGINT, sigint_handler);
+    if (savePath && !interrupted) {
+        interrupted = 1; // The main loop saves the game and comes back here
+        return;
+    }
     printf("\033[?25h");  // make cursor visible
     fflush(stdout);
     exit(1);
@@ -211,100 +809,203 @@ struct termios orig_termios; /* Store original terminal settings */
 /* Reset terminal settings on SIGINT */
 void sigint_handler(int sig_num)
 {
+    (void)sig_num;
+    if (savePath && !interrupted) {
+        interrupted = 1; // Saving isn't safe from a handler, the main loop does it and comes back here
+        return;
+    }
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
     printf("\033[?25h"); /* Make cursor visible */
     fflush(stdout);
     exit(1);
 }
+
+void sigwinch_handler(int sig_num) {
+    (void)sig_num;
+    windowResized = 1;
+}
 #endif 
 
-int main() {
+#ifdef TETRIS_FUZZ
+#define main tetrisMain // The fuzzer brings its own main, see LLVMFuzzerTestOneInput()
+#endif
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parseOptions(argc, argv, &options)) {
+        return 2;
+    }
+    if (options.bench) {
+        return runBenchmarks(&options);
+    }
+    if (options.checkGames > 0) {
+        return runChecks(&options);
+    }
+    if (options.fuzzPath) {
+        return runFuzzFile(&options);
+    }
+    if (options.stats) {
+        return printStats();
+    }
+    if (options.batchGames > 0) {
+        return runBatch(&options);
+    }
+    if (options.headless) {
+        return runHeadless(&options);
+    }
+    if (!setupPalette(&options)) {
+        return 2;
+    }
 
-    // On Unix systems, get terminal settings
+    // On Unix systems, put the terminal into raw mode once for the whole game
 #ifndef _WIN32
     /* Get current terminal settings */
     tcgetattr(STDIN_FILENO, &orig_termios);
 
-    /* Make necessary changes */
+    /* Disable canonical mode (buffered i/o) and local echo, reads return a byte at a time */
     struct termios new_termios = orig_termios;
     new_termios.c_lflag &= ~(ICANON | ECHO);
+    new_termios.c_cc[VMIN] = 1;
+    new_termios.c_cc[VTIME] = 0;
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &new_termios);
 #endif
 
 signal(SIGINT, sigint_handler);  // register the signal handler
+#ifndef _WIN32
+    signal(SIGWINCH, sigwinch_handler); // Also wakes up waitForInput() so a resize repaints right away
+#endif
 
 #ifdef _WIN32
     system("chcp 65001"); // Set code page to UTF-8, so that the border do not bug in Windows
     system("cls");
 #else
-    struct termios old_tio, new_tio;
+    system("clear");
+#endif
 
-    /* get the terminal settings for stdin */
-    tcgetattr(STDIN_FILENO,&old_tio);
+    if (options.tracePath) {
+        frameTimer.tracing = true;
+        frameTimer.tracePath = options.tracePath;
+        atexit(writeFrameTrace);
+    }
 
-    /* we want to keep the old setting to restore them a the end */
-    new_tio=old_tio;
+    if (options.versusListen || options.versusConnect) {
+        int status = playVersus(&options);
+    #ifndef _WIN32
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+    #endif
+        printf("\033[?25h");
+        return status;
+    }
 
-    /* disable canonical mode (buffered i/o) and local echo */
-    new_tio.c_lflag &=(~ICANON & ~ECHO);
+    if (options.spectate) {
+        int status = playSpectate(&options);
+    #ifndef _WIN32
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+    #endif
+        printf("\033[?25h");
+        return status;
+    }
 
-    /* set the new settings immediately */
-    tcsetattr(STDIN_FILENO,TCSANOW,&new_tio);
-    system("clear");
-#endif
+    if (options.replayPath) {
+        int status = playReplay(&options);
+    #ifndef _WIN32
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+    #endif
+        printf("\033[?25h");
+        return status;
+    }
 
-    Tetris tetris = {0};
-   
-    /* Initialize the board cells to -1 */
-    // for (int y = 0; y < BOARD_HEIGHT; ++y) {
-    //   for (int x = 0; x < BOARD_WIDTH; ++x) {
-    //     tetris.board[y][x] = -1;
-    //     }
-    // }
+    Tetris tetris;
+    uint64_t seed = options.seedGiven ? options.seed : (uint64_t)time(0);
+    if (!startGame(&options, seed, &tetris)) {
+    #ifndef _WIN32
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+    #endif
+        return 1;
+    }
 
-    // Initialize the board cells to '.'
-    for (int y = 0; y < BOARD_HEIGHT; ++y) {
-        for (int x = 0; x < BOARD_WIDTH; ++x) {
-            tetris.board[y][x] = '.';
-        }
+    if (options.spectateServe && !spectateServe(options.spectateServe, &tetris)) {
+    #ifndef _WIN32
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+    #endif
+        return 1;
+    }
+
+    if (options.recordPath) {
+        recording = (Replay){.seed = seed, .width = options.width, .height = options.height,
+                             .policy = options.randomizer, .previewDepth = options.preview,
+                             .path = options.recordPath, .game = &tetris};
+        atexit(writeReplay);
     }
 
-    srand(time(0)); // Initialize random number generator
-    tetris.nextTetromino = rand() % 8; 
-    // Place '=' character here:
-    spawnTetromino(&tetris);
-    tetris.level = 1;
-    tetris.linesCleared = 0;
-    tetris.score = 0;
-    tetris.paused = false;
-    tetris.showGhost = true;
-    tetris.toggleColors = true;  
-    tetris.showDots = false; 
+    Bot *bot = options.bot ? botCreate(options.botDepth, options.botThreads) : NULL;
 
     bool game_over_screen_displayed = false;
         bool wasJustPaused = false;
         
+    draw(&tetris); // Show the board before waiting for the first event
+    spectatePublish(&tetris);
+    uint32_t drawnRevision = tetris.revision;
 while (1) {
+        // Sleep until a key arrives or the piece is due to fall
+        if (tetris.paused) {
+            waitForInput(-1);
+        } else if (!tetris.gameOver) {
+            int timeout = update(&tetris);
+            int shiftTimeout = autoShiftDue(&tetris);
+            if (shiftTimeout >= 0 && shiftTimeout < timeout) timeout = shiftTimeout;
+            if (bot) {
+                uint64_t now = getCurrentTimeMillis();
+                int botTimeout = bot->nextKeyTime > now ? (int)(bot->nextKeyTime - now) : 0;
+                if (botTimeout < timeout) timeout = botTimeout;
+            }
+            waitForInput(timeout);
+        }
+        if (interrupted) {
+            saveGame(&tetris);
+            leaveScreen();
+            sigint_handler(SIGINT);
+        }
         input(&tetris);
+        if (bot) {
+            botInput(bot, &tetris);
+        }
 
         if (tetris.paused) {
-            if (!wasJustPaused) {
+            if (!wasJustPaused || windowResized) {
                 drawPausedScreen();
+                spectatePublish(&tetris);
                 wasJustPaused = true;
             }
             continue;  //skip everything else if the game is paused
         }
 
-        wasJustPaused = false;
+        if (wasJustPaused) {
+            clockReset(&tetris.clock); // Time spent paused doesn't count
+            wasJustPaused = false;
+        }
 
         if (!tetris.gameOver) {
-            draw(&tetris);
             update(&tetris);
+            autoShift(&tetris);
+            // Only draw when something changed, not on every wakeup
+            if (tetris.revision != drawnRevision || windowResized) {
+                draw(&tetris);
+                spectatePublish(&tetris);
+                drawnRevision = tetris.revision;
+            }
         } 
         else if (tetris.gameOver && !game_over_screen_displayed) {
             game_over_screen_displayed = true;
+            if (savePath && !gameSaved) {
+                remove(savePath); // It topped out, there is nothing left to pick up
+                recordScore(&tetris);
+            }
+            savePath = NULL; // Nothing left to save, so ^C can exit straight away
+            spectatePublish(&tetris);
             drawGameOverScreen(&tetris, tetris.score, tetris.level, tetris.linesCleared);
             _getch();
+            leaveScreen();
         printf(
 "####### ######## ######## ########  ####  ######\n"
 "  ##    ##          ##    ##     ##  ##  ##    ##\n"
@@ -332,119 +1033,3294 @@ while (1) {
     #endif
     
     printf("\033[?25h");
+    writeReplay();
+    if (bot) {
+        botFree(bot);
+    }
     
     return 0;
 }
 
-void drawPausedScreen() {
-#ifdef _WIN32
-    system("cls");
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi);
-    int horizontal_padding = (csbi.srWindow.Right - csbi.srWindow.Left - BOARD_WIDTH) / 2;
-    int vertical_padding = (csbi.srWindow.Bottom - csbi.srWindow.Top - 9) / 2;
-#else
-    printf("\033[H\033[J"); // On Unix-like systems, we can just print the escape codes directly
-    struct winsize w;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-    int horizontal_padding = (w.ws_col - BOARD_WIDTH) / 2;
-    int vertical_padding = (w.ws_row - 9) / 2;
-#endif
-
-    for(int i = 0; i < vertical_padding; i++) printf("\n");
-
-    for(int i = 0; i < horizontal_padding; i++) printf(" ");
-    printf("####################\n");
-
-    for(int i = 0; i < horizontal_padding; i++) printf(" ");
-    printf("#    GAME PAUSED   #\n");
-
-    for(int i = 0; i < horizontal_padding; i++) printf(" ");
-    printf("# Press 'p' to     #\n");
-
-    for(int i = 0; i < horizontal_padding; i++) printf(" ");
-    printf("# resume the game  #\n");
-
-    for(int i = 0; i < horizontal_padding; i++) printf(" ");
-    printf("####################\n");
+static bool parseRandomizer(const char *name, RandomizerPolicy *policy) {
+    for (int i = 0; i < sizeof(RANDOMIZER_NAMES) / sizeof(RANDOMIZER_NAMES[0]); ++i) {
+        if (strcmp(name, RANDOMIZER_NAMES[i]) == 0) {
+            *policy = i;
+            return true;
+        }
+    }
+    return false;
 }
 
-void removeFullLines(Tetris *tetris) {
-    int linesRemoved = 0;
+/* A whole, positive count, anything else is a mistake rather than a request for the default */
+static bool parseCount(const char *value, long *count) {
+    char *end;
+    errno = 0;
+    long parsed = strtol(value, &end, 0);
+    if (end == value || *end != '\0' || errno == ERANGE || parsed <= 0) {
+        return false;
+    }
+    *count = parsed;
+    return true;
+}
 
-    for (int y = 0; y < BOARD_HEIGHT; ++y) {
-        bool isFullLine = true;
-        for (int x = 0; x < BOARD_WIDTH; ++x) {
-            if (tetris->board[y][x] == '.') {
-                isFullLine = false;
-                break;
+bool parseOptions(int argc, char **argv, Options *options) {
+    *options = (Options){.maxPieces = -1, .width = BOARD_WIDTH, .height = BOARD_HEIGHT, .botDepth = 2, .botThreads = 1,
+                         .randomizer = RANDOMIZER_UNIFORM, .preview = 1, .colorDepth = -1};
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        long count;
+        if (strcmp(arg, "--headless") == 0) {
+            options->headless = true;
+        } else if (strcmp(arg, "--seed") == 0 && value) {
+            options->seed = strtoull(value, NULL, 0);
+            options->seedGiven = true;
+            ++i;
+        } else if (strcmp(arg, "--inputs") == 0 && value) {
+            options->inputsPath = value;
+            ++i;
+        } else if (strcmp(arg, "--pieces") == 0 && value && parseCount(value, &options->maxPieces)) {
+            ++i;
+        } else if (strcmp(arg, "--batch") == 0 && value && parseCount(value, &options->batchGames)) {
+            ++i;
+        } else if (strcmp(arg, "--bench") == 0) {
+            options->bench = true;
+            if (value && value[0] != '-') {
+                options->benchFilter = value;
+                ++i;
             }
-        }
-
-        if (isFullLine) {
-            for (int y2 = y; y2 > 0; --y2) {
-                memcpy(tetris->board[y2], tetris->board[y2 - 1], BOARD_WIDTH);
+        } else if (strcmp(arg, "--check") == 0 && value && parseCount(value, &options->checkGames)) {
+            ++i;
+        } else if (strcmp(arg, "--fuzz") == 0 && value) {
+            options->fuzzPath = value;
+            ++i;
+        } else if (strcmp(arg, "--width") == 0 && value) {
+            options->width = atoi(value);
+            ++i;
+        } else if (strcmp(arg, "--height") == 0 && value) {
+            options->height = atoi(value);
+            ++i;
+        } else if (strcmp(arg, "--board") == 0 && value && strcmp(value, "standard") == 0) {
+            options->width = 10;
+            options->height = 20;
+            ++i;
+        } else if (strcmp(arg, "--board") == 0 && value && strcmp(value, "wide") == 0) {
+            options->width = 40;
+            options->height = 20;
+            ++i;
+        } else if (strcmp(arg, "--board") == 0 && value && strcmp(value, "tall") == 0) {
+            options->width = 10;
+            options->height = 60;
+            ++i;
+        } else if (strcmp(arg, "--trace") == 0 && value) {
+            options->tracePath = value;
+            ++i;
+        } else if (strcmp(arg, "--threads") == 0 && value && parseCount(value, &count)) {
+            if (count > BATCH_MAX_THREADS) {
+                fprintf(stderr, "--threads must be 1 to %d\n", BATCH_MAX_THREADS);
+                return false;
             }
-            memset(tetris->board[0], '.', BOARD_WIDTH);
-            linesRemoved++;
+            options->threads = (int)count;
+            ++i;
+        } else if (strcmp(arg, "--record") == 0 && value) {
+            options->recordPath = value;
+            ++i;
+        } else if (strcmp(arg, "--replay") == 0 && value) {
+            options->replayPath = value;
+            ++i;
+        } else if (strcmp(arg, "--seek") == 0 && value && parseCount(value, &options->seekPiece)) {
+            ++i;
+        } else if (strcmp(arg, "--randomizer") == 0 && value && parseRandomizer(value, &options->randomizer)) {
+            ++i;
+        } else if (strcmp(arg, "--preview") == 0 && value) {
+            options->preview = atoi(value);
+            ++i;
+        } else if (strcmp(arg, "--bot") == 0) {
+            options->bot = true;
+        } else if (strcmp(arg, "--bot-depth") == 0 && value) {
+            options->botDepth = atoi(value);
+            ++i;
+        } else if (strcmp(arg, "--bot-threads") == 0 && value && parseCount(value, &count)) {
+            if (count > BOT_MAX_THREADS) {
+                fprintf(stderr, "--bot-threads must be 1 to %d\n", BOT_MAX_THREADS);
+                return false;
+            }
+            options->botThreads = (int)count;
+            ++i;
+        } else if (strcmp(arg, "--versus-listen") == 0 && value) {
+            options->versusListen = value;
+            ++i;
+        } else if (strcmp(arg, "--versus-connect") == 0 && value) {
+            options->versusConnect = value;
+            ++i;
+        } else if (strcmp(arg, "--spectate-serve") == 0 && value) {
+            options->spectateServe = value;
+            ++i;
+        } else if (strcmp(arg, "--spectate") == 0 && value) {
+            options->spectate = value;
+            ++i;
+        } else if (strcmp(arg, "--stats") == 0) {
+            options->stats = true;
+        } else if (strcmp(arg, "--theme") == 0 && value) {
+            options->themePath = value;
+            ++i;
+        } else if (strcmp(arg, "--color-depth") == 0 && value) {
+            options->colorDepth = -2;
+            for (int depth = COLOR_DEPTH_16; depth <= COLOR_DEPTH_TRUE; ++depth) {
+                if (strcmp(value, COLOR_DEPTH_NAMES[depth]) == 0) {
+                    options->colorDepth = depth;
+                }
+            }
+            if (options->colorDepth == -2) {
+                fprintf(stderr, "--color-depth must be 16, 256 or truecolor\n");
+                return false;
+            }
+            ++i;
+        } else if (strcmp(arg, "--half-block") == 0) {
+            options->halfBlock = true;
+        } else if (strcmp(arg, "--new") == 0) {
+            options->newGame = true;
+        } else if (strcmp(arg, "--load") == 0 && value) {
+            options->loadPath = value;
+            ++i;
+        } else if (strcmp(arg, "--save") == 0 && value) {
+            options->savePath = value;
+            ++i;
+        } else {
+            fprintf(stderr,
+                "usage: %s [--seed N] [--record FILE] [--trace FILE] [--board standard|wide|tall] [--width N] [--height N]\n"
+                "          [--randomizer uniform|bag7|bag8|history] [--preview 1-%d] [--bot] [--bot-depth 1-3] [--bot-threads N]\n"
+                "          [--new | --load FILE] [--save FILE] [--half-block] [--theme FILE] [--color-depth 16|256|truecolor]\n"
+                "          [--spectate-serve [HOST:]PORT|PATH]\n"
+                "       %s --versus-listen [HOST:]PORT|PATH [board and randomizer options] [--bot]\n"
+                "       %s --versus-connect [HOST:]PORT|PATH [--bot]\n"
+                "       %s --spectate [HOST:]PORT|PATH\n"
+                "       %s --replay FILE [--seek N] [--trace FILE]\n"
+                "       %s --headless [--seed N | --load FILE] [--inputs FILE | --replay FILE] [--bot] [--pieces N] [--save FILE]\n"
+                "       %s --batch GAMES [--threads N] [--seed N] [--inputs FILE | --bot] [--pieces N]\n"
+                "       %s --bench [NAME]\n"
+                "       %s --check GAMES [--seed N] | --fuzz FILE\n"
+                "       %s --stats\n", argv[0], PREVIEW_MAX, argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+            return false;
         }
     }
-
-    if (linesRemoved > 0) {
-        int lineScore[] = {0, 100, 300, 500, 800};
-        int bonus = (linesRemoved - 1) * 100;
-        tetris->score += (lineScore[linesRemoved] + bonus) * tetris->level;
-        tetris->linesCleared += linesRemoved;
-
-        if (tetris->linesCleared >= tetris->level * 10) {
-            tetris->level++;
-        }
+    if (options->width < BOARD_MIN_SIZE || options->width > BOARD_MAX_WIDTH ||
+        options->height < BOARD_MIN_SIZE || options->height > BOARD_MAX_HEIGHT) {
+        fprintf(stderr, "board must be %d to %d columns wide and %d to %d rows tall\n",
+                BOARD_MIN_SIZE, BOARD_MAX_WIDTH, BOARD_MIN_SIZE, BOARD_MAX_HEIGHT);
+        return false;
+    }
+    if (options->preview < 1 || options->preview > PREVIEW_MAX) {
+        fprintf(stderr, "--preview must be 1 to %d\n", PREVIEW_MAX);
+        return false;
     }
+    if (options->botDepth < 1 || options->botDepth > BOT_MAX_DEPTH) {
+        fprintf(stderr, "--bot-depth must be 1 to %d\n", BOT_MAX_DEPTH);
+        return false;
+    }
+    if (options->bot && (options->headless || options->batchGames > 0) && options->maxPieces < 0) {
+        fprintf(stderr, "--bot needs --pieces N without a terminal, its games may never end\n");
+        return false;
+    }
+    if ((options->versusListen || options->versusConnect) &&
+        (options->headless || options->batchGames > 0 || options->recordPath || options->replayPath || options->loadPath)) {
+        fprintf(stderr, "versus games are live only, and replays can't hold the garbage they exchange\n");
+        return false;
+    }
+    if (options->spectateServe && (options->headless || options->batchGames > 0 || options->replayPath ||
+                                   options->versusListen || options->versusConnect || options->spectate)) {
+        fprintf(stderr, "--spectate-serve publishes a live game, start one to go with it\n");
+        return false;
+    }
+    if (options->spectate && (options->headless || options->batchGames > 0 || options->replayPath ||
+                              options->versusListen || options->versusConnect)) {
+        fprintf(stderr, "--spectate only watches, it can't be combined with playing\n");
+        return false;
+    }
+    if (options->recordPath && (options->headless || options->batchGames > 0 || options->replayPath)) {
+        fprintf(stderr, "--record records live games, headless, batch and replayed games are already repeatable\n");
+        return false;
+    }
+    if (options->loadPath && (options->recordPath || options->replayPath || options->batchGames > 0)) {
+        fprintf(stderr, "--load can't be combined with recording, replays or batches, they start from a seed\n");
+        return false;
+    }
+    return true;
 }
 
-void spawnTetromino(Tetris *tetris) {
-    tetris->currentTetromino = tetris->nextTetromino;
-    tetris->nextTetromino = (rand() % 8);
-    tetris->rotation = 0;
+/*
+  Play a game with no terminal. The inputs file holds one key per tick, '.' is
+  a tick with no key and a decimal count repeats the key after it, so "60."
+  waits a second and "3d" moves right three times. Line breaks are ignored.
+  Once the inputs run out gravity plays on until the game ends.
+*/
+int runHeadless(const Options *options) {
+    char *inputs = NULL;
+    long inputLength = 0;
+    if (options->inputsPath && !(inputs = readFile(options->inputsPath, &inputLength))) {
+        return 1;
+    }
 
-    const char *shape = NULL;
-    if (tetris->currentTetromino == INV_L) {
-        shape = INVERTED_L_SHAPES[tetris->rotation];
+    Tetris tetris;
+    uint64_t seed = options->seed;
+    uint64_t start = getCurrentTimeMillis();
+
+    if (options->replayPath) {
+        // Replays carry their own seed and board size
+        Replay replay;
+        if (!loadReplay(options->replayPath, &replay)) {
+            return 1;
+        }
+        seed = replay.seed;
+        tetris_init(&tetris, seed, replay.width, replay.height, replay.policy, replay.previewDepth);
+        replayRun(&replay, &tetris, UINT64_MAX, options->maxPieces);
+        freeReplay(&replay);
     } else {
-        shape = TETROMINO_SHAPES[tetris->currentTetromino][tetris->rotation];
+        if (options->loadPath) {
+            if (!readSnapshotFile(options->loadPath, &tetris)) {
+                fprintf(stderr, "%s is not a snapshot this version can load\n", options->loadPath);
+                free(inputs);
+                return 1;
+            }
+            tetris.paused = false; // Saved while paused, nothing here would unpause it
+        } else {
+            tetris_init(&tetris, seed, options->width, options->height, options->randomizer, options->preview);
+        }
+        playInputs(&tetris, inputs, inputLength, options->maxPieces);
+        free(inputs);
+        if (options->bot) {
+            Bot *bot = botCreate(options->botDepth, options->botThreads);
+            playBot(&tetris, bot, options->maxPieces);
+            botFree(bot);
+        } else {
+            playGravity(&tetris, options->maxPieces);
+        }
     }
 
-    int idx = 0;
-    for (int y = 0; y < 4; ++y) {
-        for (int x = 0; x < 4; ++x) {
-            if (shape[y * 4 + x] == '#') {
-                tetris->currentPositions[idx++] = (Point){x + BOARD_WIDTH / 2 - 2, y};
-            }
+    uint64_t elapsed = getCurrentTimeMillis() - start;
+    printf("seed=%llu score=%d level=%d lines=%d pieces=%ld ticks=%llu gameover=%d\n",
+           (unsigned long long)tetris.seed, tetris.score, tetris.level, tetris.linesCleared,
+           tetris.pieces, (unsigned long long)tetris.tick, tetris.gameOver);
+    fprintf(stderr, "%ld pieces in %llu ms\n", tetris.pieces, (unsigned long long)elapsed);
+    if (options->savePath && !writeSnapshotFile(options->savePath, &tetris)) {
+        fprintf(stderr, "cannot write %s\n", options->savePath);
+        return 1;
+    }
+    return 0;
+}
+
+char *readFile(const char *path, long *length) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    // Read until end of file rather than trusting the size, pipes and FIFOs don't have one
+    size_t size = 0, capacity = 4096;
+    char *data = malloc(capacity);
+    while (data) {
+        size += fread(data + size, 1, capacity - size, file);
+        if (size < capacity) {
+            break;
         }
+        char *grown = realloc(data, capacity * 2);
+        if (!grown) {
+            free(data);
+        }
+        data = grown;
+        capacity *= 2;
+    }
+    if (!data || ferror(file)) {
+        fprintf(stderr, "cannot read %s: %s\n", path, data ? strerror(errno) : "out of memory");
+        free(data);
+        fclose(file);
+        return NULL;
     }
+    fclose(file);
+    *length = (long)size;
+    return data;
 }
 
-void drawNextTetromino(Tetromino tetromino, int row, Tetris *tetris) {
-    const char *shape = TETROMINO_SHAPES[tetromino][0];
-    for (int x = 0; x < 4; ++x) {
-    if (tetris->toggleColors) {
-        if (shape[row * 4 + x] == '#') {
-            printf("%s \033[0m", TETRIS_COLORS[tetromino]);
-        } else {
-            printf(" ");
+/*
+  Play a key script. The script holds one key per tick, '.' is a tick with
+  no key and a decimal count repeats the key after it, so "60." waits a
+  second and "3d" moves right three times. Line breaks are ignored. 'p' is
+  skipped too, a paused game would never run another tick.
+*/
+void playInputs(Tetris *tetris, const char *inputs, long length, long maxPieces) {
+    long count = 0;
+    for (long i = 0; i < length && !tetris->gameOver; ++i) {
+        if (maxPieces >= 0 && tetris->pieces >= maxPieces) {
+            break;
+        }
+        char key = inputs[i];
+        if (key >= '0' && key <= '9') {
+            count = count * 10 + (key - '0');
+            continue;
+        }
+        if (key == '\n' || key == '\r' || key == 'p') {
+            count = 0;
+            continue;
+        }
+        long repeat = count > 0 ? count : 1;
+        count = 0;
+        if (key == '.') {
+            tetris_advance(tetris, repeat);
+            continue;
+        }
+        for (long r = 0; r < repeat && !tetris->gameOver; ++r) {
+            applyKey(tetris, key);
+            tetris_tick(tetris);
         }
-    } else {
-      if (shape[row * 4 + x] == '#') {
-        putchar('#');
-      } else {
-        putchar(' ');
-      }
     }
-  }
 }
 
-uint64_t getCurrentTimeMillis() {
-#ifdef _WIN32
+/* A player that turns and shifts every piece at random, then hard drops it */
+void playRandom(Tetris *tetris, uint64_t seed, long maxPieces) {
+    Rng dice;
+    rngSeed(&dice, seed);
+    while (!tetris->gameOver && (maxPieces < 0 || tetris->pieces < maxPieces)) {
+        int turns = rngBelow(&dice, 4);
+        int shift = (int)rngBelow(&dice, tetris->width) - tetris->width / 2;
+        for (int i = 0; i < turns; ++i) {
+            applyKey(tetris, 'w');
+            tetris_tick(tetris);
+        }
+        for (int i = 0; i < abs(shift); ++i) {
+            applyKey(tetris, shift < 0 ? 'a' : 'd');
+            tetris_tick(tetris);
+        }
+        applyKey(tetris, ' ');
+        tetris_tick(tetris);
+    }
+}
+
+/* Let gravity play out the game with no more keys */
+void playGravity(Tetris *tetris, long maxPieces) {
+    while (!tetris->gameOver && (maxPieces < 0 || tetris->pieces < maxPieces)) {
+        tetris_advance(tetris, ticksUntilEvent(tetris));
+    }
+}
+
+static void snapshotVarint(uint8_t **out, uint64_t value) {
+    while (value >= 0x80) {
+        *(*out)++ = (uint8_t)(value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *(*out)++ = (uint8_t)value;
+}
+
+static void snapshotWord(uint8_t **out, uint64_t value) {
+    for (int i = 0; i < 8; ++i) {
+        *(*out)++ = (uint8_t)(value >> (8 * i));
+    }
+}
+
+/* Positions can be slightly negative, zigzag keeps them one byte */
+static uint64_t zigzag(int value) {
+    return value < 0 ? ((uint64_t)-(int64_t)value << 1) - 1 : (uint64_t)value << 1;
+}
+
+/* One bit per column of a board row, rowBytes of it, lowest column first */
+static void snapshotPlaneRow(uint8_t **out, BoardRow bits, int rowBytes) {
+    for (int i = 0; i < rowBytes; ++i) {
+        *(*out)++ = (uint8_t)(bits >> (8 * i));
+    }
+}
+
+/*
+  Pack the whole game into data, which must hold SNAPSHOT_MAX_SIZE bytes, and
+  return the length. After the magic, version and board size come the flags,
+  the seed the game started from, the counters as varints, the falling
+  piece, the randomizer (policy and preview depth sharing a byte as in
+  replays, the PCG state, the rest of the bag, the history and the preview
+  in dealing order) and then the board. Rows above the stack are left out,
+  and the rest go as bit-planes: occupancy, then the four bits of each
+  block's color. Column heights, holes and the ghost are worked out again
+  on load.
+*/
+size_t saveSnapshot(const Tetris *tetris, uint8_t *data) {
+    uint8_t *out = data;
+    memcpy(out, SNAPSHOT_MAGIC, 4);
+    out += 4;
+    *out++ = SNAPSHOT_VERSION;
+    *out++ = tetris->width;
+    *out++ = tetris->height;
+    *out++ = tetris->gameOver | tetris->paused << 1 | tetris->showGhost << 2 | tetris->toggleColors << 3 |
+             tetris->showDots << 4 | tetris->showFrameStats << 5 | tetris->halfBlock << 6;
+
+    snapshotWord(&out, tetris->seed);
+    snapshotVarint(&out, tetris->tick);
+    snapshotVarint(&out, tetris->pieces);
+    snapshotVarint(&out, tetris->score);
+    snapshotVarint(&out, tetris->level);
+    snapshotVarint(&out, tetris->linesCleared);
+    snapshotVarint(&out, tetris->gravityFraction);
+    snapshotVarint(&out, tetris->lockTimer);
+    snapshotVarint(&out, tetris->lockResets);
+    snapshotVarint(&out, zigzag(tetris->lowestY));
+
+    *out++ = tetris->currentTetromino;
+    *out++ = tetris->rotation;
+    snapshotVarint(&out, zigzag(tetris->position.x));
+    snapshotVarint(&out, zigzag(tetris->position.y));
+
+    const Randomizer *randomizer = &tetris->randomizer;
+    *out++ = randomizer->policy | randomizer->previewDepth << 4;
+    snapshotWord(&out, randomizer->rng.state);
+    snapshotWord(&out, randomizer->rng.increment);
+    *out++ = randomizer->bagLeft;
+    for (int i = 0; i < randomizer->bagLeft; ++i) {
+        *out++ = randomizer->bag[i];
+    }
+    for (int i = 0; i < HISTORY_LENGTH; ++i) {
+        *out++ = randomizer->history[i];
+    }
+    for (int i = 0; i < randomizer->previewDepth; ++i) {
+        *out++ = randomizerPeek(randomizer, i);
+    }
+
+    int stackTop = 0;
+    while (stackTop < tetris->height && tetris->rows[stackTop] == 0) {
+        stackTop++;
+    }
+    snapshotVarint(&out, stackTop);
+    int rowBytes = (tetris->width + 7) / 8;
+    for (int y = stackTop; y < tetris->height; ++y) {
+        snapshotPlaneRow(&out, tetris->rows[y], rowBytes);
+    }
+    for (int bit = 0; bit < 4; ++bit) {
+        for (int y = stackTop; y < tetris->height; ++y) {
+            BoardRow plane = 0;
+            for (int x = 0; x < tetris->width; ++x) {
+                plane |= (BoardRow)(tetris->colors[y][x] >> bit & 1) << x;
+            }
+            snapshotPlaneRow(&out, plane & tetris->rows[y], rowBytes);
+        }
+    }
+    return out - data;
+}
+
+static uint8_t readByte(SnapshotReader *reader) {
+    if (reader->position >= reader->length) {
+        reader->failed = true;
+        return 0;
+    }
+    return reader->data[reader->position++];
+}
+
+static uint64_t readVarint(SnapshotReader *reader) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t byte = readByte(reader);
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    reader->failed = true;
+    return 0;
+}
+
+static int readZigzag(SnapshotReader *reader) {
+    uint64_t value = readVarint(reader);
+    return value & 1 ? -(int)(value >> 1) - 1 : (int)(value >> 1);
+}
+
+static uint64_t readWord(SnapshotReader *reader) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value |= (uint64_t)readByte(reader) << (8 * i);
+    }
+    return value;
+}
+
+static BoardRow readPlaneRow(SnapshotReader *reader, int rowBytes) {
+    BoardRow bits = 0;
+    for (int i = 0; i < rowBytes; ++i) {
+        bits |= (BoardRow)readByte(reader) << (8 * i);
+    }
+    return bits;
+}
+
+/* Restore a game saved by saveSnapshot(), leaves tetris alone and returns false if the data doesn't hold one */
+bool loadSnapshot(Tetris *tetris, const uint8_t *data, size_t length) {
+    SnapshotReader reader = {data, length, 0, false};
+    if (length < 8 || memcmp(data, SNAPSHOT_MAGIC, 4) != 0 || data[4] != SNAPSHOT_VERSION ||
+        data[5] < BOARD_MIN_SIZE || data[5] > BOARD_MAX_WIDTH || data[6] < BOARD_MIN_SIZE || data[6] > BOARD_MAX_HEIGHT) {
+        return false;
+    }
+    reader.position = 8;
+
+    // Build the game aside, so a bad snapshot can't leave a half loaded one
+    Tetris loaded;
+    memset(&loaded, 0, sizeof(loaded));
+    loaded.width = data[5];
+    loaded.height = data[6];
+    loaded.fullRow = loaded.width == 64 ? ~(BoardRow)0 : ((BoardRow)1 << loaded.width) - 1;
+    uint8_t flags = data[7];
+    loaded.gameOver = flags & 1;
+    loaded.paused = flags >> 1 & 1;
+    loaded.showGhost = flags >> 2 & 1;
+    loaded.toggleColors = flags >> 3 & 1;
+    loaded.showDots = flags >> 4 & 1;
+    loaded.showFrameStats = flags >> 5 & 1;
+    loaded.halfBlock = flags >> 6 & 1;
+
+    loaded.seed = readWord(&reader);
+    loaded.tick = readVarint(&reader);
+    loaded.pieces = (long)readVarint(&reader);
+    loaded.score = (int)readVarint(&reader);
+    loaded.level = (int)readVarint(&reader);
+    loaded.linesCleared = (int)readVarint(&reader);
+    loaded.gravityFraction = (uint32_t)readVarint(&reader);
+    loaded.lockTimer = (uint32_t)readVarint(&reader);
+    loaded.lockResets = (int)readVarint(&reader);
+    loaded.lowestY = readZigzag(&reader);
+
+    int piece = readByte(&reader);
+    int rotation = readByte(&reader);
+    int x = readZigzag(&reader);
+    int y = readZigzag(&reader);
+
+    Randomizer *randomizer = &loaded.randomizer;
+    uint8_t packed = readByte(&reader);
+    randomizer->policy = packed & 0xf;
+    randomizer->previewDepth = packed >> 4;
+    randomizer->rng.state = readWord(&reader);
+    randomizer->rng.increment = readWord(&reader);
+    randomizer->bagLeft = readByte(&reader);
+    bool piecesValid = piece < 8 && randomizer->bagLeft <= 8;
+    for (int i = 0; i < randomizer->bagLeft && i < 8; ++i) {
+        randomizer->bag[i] = readByte(&reader);
+        piecesValid &= randomizer->bag[i] < 8;
+    }
+    for (int i = 0; i < HISTORY_LENGTH; ++i) {
+        randomizer->history[i] = readByte(&reader);
+        piecesValid &= randomizer->history[i] < 8;
+    }
+    for (int i = 0; i < randomizer->previewDepth && i < PREVIEW_MAX; ++i) {
+        randomizer->preview[i] = readByte(&reader);
+        piecesValid &= randomizer->preview[i] < 8;
+    }
+
+    int stackTop = (int)readVarint(&reader);
+    if (reader.failed || !piecesValid || rotation > 3 || loaded.level < 1 || loaded.gravityFraction > 0xffff || loaded.lockTimer >= LOCK_DELAY_TICKS ||
+        randomizer->policy > RANDOMIZER_HISTORY || randomizer->previewDepth < 1 || randomizer->previewDepth > PREVIEW_MAX ||
+        !(randomizer->rng.increment & 1) || stackTop > loaded.height) {
+        return false;
+    }
+    int rowBytes = (loaded.width + 7) / 8;
+    for (int row = stackTop; row < loaded.height; ++row) {
+        loaded.rows[row] = readPlaneRow(&reader, rowBytes) & loaded.fullRow;
+    }
+    for (int bit = 0; bit < 4; ++bit) {
+        for (int row = stackTop; row < loaded.height; ++row) {
+            BoardRow plane = readPlaneRow(&reader, rowBytes) & loaded.rows[row];
+            for (int column = 0; column < loaded.width; ++column) {
+                loaded.colors[row][column] |= (plane >> column & 1) << bit;
+            }
+        }
+    }
+    if (reader.failed) {
+        return false;
+    }
+    for (int row = stackTop; row < loaded.height; ++row) {
+        for (int column = 0; column < loaded.width; ++column) {
+            if (loaded.colors[row][column] > GARBAGE_COLOR_INDEX) {
+                return false; // Every color has to be one the palette has
+            }
+        }
+    }
+
+    // The piece has to be on the board, and free unless the game is over
+    loaded.currentTetromino = piece;
+    for (int i = 0; i < 4; ++i) {
+        const Point *cell = &PIECE_CELLS[piece][rotation][i];
+        if (x + cell->x < 0 || x + cell->x >= loaded.width || y + cell->y < 0 || y + cell->y >= loaded.height) {
+            return false;
+        }
+    }
+    if (!loaded.gameOver && !pieceFits(&loaded, piece, rotation, x, y)) {
+        return false;
+    }
+    recountBoard(&loaded);
+
+    // placePiece() would count this as a move, keep the lock delay as it was
+    uint32_t lockTimer = loaded.lockTimer;
+    int lockResets = loaded.lockResets, lowestY = loaded.lowestY;
+    placePiece(&loaded, rotation, x, y);
+    loaded.lockTimer = lockTimer;
+    loaded.lockResets = lockResets;
+    loaded.lowestY = lowestY;
+    loaded.lockBottom = -1;
+
+    loaded.revision = tetris->revision + 1; // Anything drawn from the old game is out of date
+    *tetris = loaded;
+    return true;
+}
+
+bool writeSnapshotFile(const char *path, const Tetris *tetris) {
+    uint8_t data[SNAPSHOT_MAX_SIZE];
+    size_t length = saveSnapshot(tetris, data);
+    return writeFileAtomic(path, data, length);
+}
+
+/*
+  Replace a file so that a crash or ^C leaves either the old contents or the
+  new ones: one write to a file next to it, flushed to disk, then renamed
+  over. The directory is flushed too so the rename itself sticks.
+*/
+bool writeFileAtomic(const char *path, const void *data, size_t length) {
+    char temporary[4096];
+    if (snprintf(temporary, sizeof(temporary), "%s.tmp", path) >= (int)sizeof(temporary)) {
+        return false;
+    }
+#ifdef _WIN32
+    FILE *file = fopen(temporary, "wb");
+    if (!file) {
+        return false;
+    }
+    bool written = fwrite(data, 1, length, file) == length && fflush(file) == 0 && _commit(_fileno(file)) == 0;
+    written &= fclose(file) == 0;
+    if (!written || !MoveFileExA(temporary, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        remove(temporary);
+        return false;
+    }
+#else
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool written = write(fd, data, length) == (ssize_t)length && fsync(fd) == 0;
+    written &= close(fd) == 0;
+    if (!written || rename(temporary, path) != 0) {
+        remove(temporary);
+        return false;
+    }
+    // The directory entry is what the rename changed
+    char directory[4096];
+    snprintf(directory, sizeof(directory), "%s", path);
+    char *slash = strrchr(directory, '/');
+    if (slash) {
+        *(slash == directory ? slash + 1 : slash) = '\0';
+    } else {
+        strcpy(directory, ".");
+    }
+    int directoryFd = open(directory, O_RDONLY);
+    if (directoryFd >= 0) {
+        fsync(directoryFd);
+        close(directoryFd);
+    }
+#endif
+    return true;
+}
+
+/* A missing file is not an error here, there is simply no saved game */
+bool readSnapshotFile(const char *path, Tetris *tetris) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    uint8_t data[SNAPSHOT_MAX_SIZE];
+    size_t length = fread(data, 1, sizeof(data), file);
+    fclose(file);
+    return loadSnapshot(tetris, data, length);
+}
+
+/* A file in the user's home directory, false if there isn't one */
+bool homeFile(const char *name, char *path, size_t size) {
+#ifdef _WIN32
+    const char *home = getenv("USERPROFILE");
+#else
+    const char *home = getenv("HOME");
+#endif
+    return home && snprintf(path, size, "%s/%s", home, name) < (int)size;
+}
+
+/* The save slot when --save doesn't name one */
+const char *defaultSavePath() {
+    static char path[4096];
+    return homeFile(".tetris.sav", path, sizeof(path)) ? path : NULL;
+}
+
+/*
+  Set up the live game: the snapshot --load names, else the game saved last
+  time, else a new one. Bot games and recordings always start fresh, and bot
+  games are never saved or logged.
+*/
+bool startGame(const Options *options, uint64_t seed, Tetris *tetris) {
+    savePath = options->bot ? NULL : options->savePath ? options->savePath : defaultSavePath();
+    if (options->bot || !homeFile(".tetris.scores", scorePath, sizeof(scorePath))) {
+        scorePath[0] = '\0'; // The bot's games would crowd everyone off the table
+    }
+    if (options->loadPath) {
+        if (!readSnapshotFile(options->loadPath, tetris)) {
+            fprintf(stderr, "%s is not a snapshot this version can load\n", options->loadPath);
+            return false;
+        }
+    } else if (options->newGame || options->recordPath || options->bot || !savePath || !readSnapshotFile(savePath, tetris)) {
+        tetris_init(tetris, seed, options->width, options->height, options->randomizer, options->preview);
+    }
+    tetris->paused = false;
+    tetris->halfBlock |= options->halfBlock;
+    return true;
+}
+
+void saveGame(const Tetris *tetris) {
+    if (savePath && !tetris->gameOver) {
+        gameSaved = writeSnapshotFile(savePath, tetris);
+    }
+}
+
+static uint32_t scoreChecksum(const ScoreRecord *record) {
+    const uint8_t *bytes = (const uint8_t *)record + offsetof(ScoreRecord, seed);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(ScoreRecord) - offsetof(ScoreRecord, seed); ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static bool scoreValid(const ScoreRecord *record) {
+    return record->magic == SCORE_MAGIC && record->games > 0 && record->checksum == scoreChecksum(record);
+}
+
+/* Log the game that just ended, if live games are logged */
+void recordScore(const Tetris *tetris) {
+    if (!scorePath[0]) {
+        return;
+    }
+    ScoreRecord record = {
+        .magic = SCORE_MAGIC,
+        .seed = tetris->seed,
+        .endedAt = (int64_t)time(NULL),
+        .durationMillis = tetris->tick * 1000 / TICK_RATE,
+        .score = (uint64_t)tetris->score,
+        .level = tetris->level,
+        .lines = tetris->linesCleared,
+        .pieces = (uint32_t)tetris->pieces,
+        .games = 1,
+        .width = tetris->width,
+        .height = tetris->height,
+    };
+    record.checksum = scoreChecksum(&record);
+    if (appendScore(scorePath, &record)) {
+        lastScore = record;
+    }
+}
+
+/*
+  Add a record with a single write and flush it to disk. A log whose length
+  isn't a whole number of records lost the end of one, so it is compacted
+  first, or the new record would be misaligned with every one before it.
+*/
+bool appendScore(const char *path, const ScoreRecord *record) {
+    FILE *probe = fopen(path, "rb");
+    long length = 0;
+    if (probe) {
+        fseek(probe, 0, SEEK_END);
+        length = ftell(probe);
+        fclose(probe);
+    }
+    if (length % sizeof(ScoreRecord) != 0 && !compactScores(path)) {
+        return false;
+    }
+    length -= length % sizeof(ScoreRecord);
+
+#ifdef _WIN32
+    FILE *file = fopen(path, "ab");
+    if (!file) {
+        return false;
+    }
+    bool written = fwrite(record, sizeof(*record), 1, file) == 1 && fflush(file) == 0 && _commit(_fileno(file)) == 0;
+    written &= fclose(file) == 0;
+#else
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool written = write(fd, record, sizeof(*record)) == (ssize_t)sizeof(*record) && fsync(fd) == 0;
+    written &= close(fd) == 0;
+#endif
+    if (written && length / (long)sizeof(ScoreRecord) + 1 >= SCORE_COMPACT_RECORDS) {
+        compactScores(path);
+    }
+    return written;
+}
+
+/* The whole log as records, mapped where mmap is available; *mapping is what unmapScores() releases */
+static const ScoreRecord *mapScores(const char *path, size_t *count, void **mapping, size_t *mappedLength) {
+    *count = 0;
+    *mapping = NULL;
+    *mappedLength = 0;
+#ifdef _WIN32
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    void *data = length > 0 ? malloc(length) : NULL;
+    if (!data) {
+        fclose(file);
+        return NULL;
+    }
+    length = fread(data, 1, length, file);
+    fclose(file);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat info;
+    void *data = NULL;
+    long length = fstat(fd, &info) == 0 ? (long)info.st_size : 0;
+    if (length > 0) {
+        data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            data = NULL;
+        }
+    }
+    close(fd);
+    if (!data) {
+        return NULL;
+    }
+#endif
+    *mapping = data;
+    *mappedLength = length;
+    *count = length / sizeof(ScoreRecord);
+    return data;
+}
+
+static void unmapScores(void *mapping, size_t mappedLength) {
+#ifdef _WIN32
+    free(mapping);
+#else
+    if (mapping) {
+        munmap(mapping, mappedLength);
+    }
+#endif
+}
+
+/* Keep best sorted by score, highest first, and no longer than count */
+static int insertScore(ScoreRecord *best, int found, int count, const ScoreRecord *record) {
+    int at = found < count ? found : count - 1;
+    if (found == count && record->score <= best[at].score) {
+        return found;
+    }
+    while (at > 0 && best[at - 1].score < record->score) {
+        best[at] = best[at - 1];
+        at--;
+    }
+    best[at] = *record;
+    return found < count ? found + 1 : found;
+}
+
+static void addTotals(ScoreRecord *totals, const ScoreRecord *record) {
+    totals->games += record->games;
+    totals->score += record->score;
+    totals->lines += record->lines;
+    totals->pieces += record->pieces;
+    totals->durationMillis += record->durationMillis;
+    if (record->endedAt > totals->endedAt) {
+        totals->endedAt = record->endedAt;
+    }
+}
+
+/*
+  The best games in the log, highest score first, and optionally the totals
+  over every game ever logged. Records that fail their checksum are skipped.
+  Returns how many were found.
+*/
+int topScores(const char *path, ScoreRecord *best, int count, ScoreRecord *totals) {
+    if (totals) {
+        *totals = (ScoreRecord){0};
+    }
+    size_t recordCount;
+    void *mapping;
+    size_t mappedLength;
+    const ScoreRecord *records = mapScores(path, &recordCount, &mapping, &mappedLength);
+    int found = 0;
+    for (size_t i = 0; i < recordCount; ++i) {
+        if (!scoreValid(&records[i])) {
+            continue;
+        }
+        if (totals) {
+            addTotals(totals, &records[i]);
+        }
+        if (records[i].games == 1 && count > 0) {
+            found = insertScore(best, found, count, &records[i]);
+        }
+    }
+    unmapScores(mapping, mappedLength);
+    return found;
+}
+
+/*
+  Rewrite the log as its best SCORE_TABLE_SIZE games plus one summary of
+  everything else, dropping damaged records, and swap it in atomically.
+*/
+bool compactScores(const char *path) {
+    static ScoreRecord kept[SCORE_TABLE_SIZE + 1];
+    ScoreRecord totals;
+    int found = topScores(path, kept, SCORE_TABLE_SIZE, &totals);
+
+    // Whatever isn't kept one by one is what the summary stands for
+    ScoreRecord summary = totals;
+    for (int i = 0; i < found; ++i) {
+        summary.games -= kept[i].games;
+        summary.score -= kept[i].score;
+        summary.lines -= kept[i].lines;
+        summary.pieces -= kept[i].pieces;
+        summary.durationMillis -= kept[i].durationMillis;
+    }
+    int count = found;
+    if (summary.games > 0) {
+        summary.magic = SCORE_MAGIC;
+        summary.checksum = scoreChecksum(&summary);
+        kept[count++] = summary;
+    }
+    return writeFileAtomic(path, kept, count * sizeof(ScoreRecord));
+}
+
+static void formatDuration(char *text, size_t size, uint64_t millis) {
+    uint64_t seconds = millis / 1000;
+    if (seconds >= 3600) {
+        snprintf(text, size, "%lluh %02llum", (unsigned long long)(seconds / 3600), (unsigned long long)(seconds / 60 % 60));
+    } else {
+        snprintf(text, size, "%llum %02llus", (unsigned long long)(seconds / 60), (unsigned long long)(seconds % 60));
+    }
+}
+
+/* --stats: the best games and the totals from the score log */
+int printStats() {
+    char path[4096];
+    if (!homeFile(".tetris.scores", path, sizeof(path))) {
+        fprintf(stderr, "no home directory to find the score log in\n");
+        return 1;
+    }
+    ScoreRecord best[10], totals;
+    int found = topScores(path, best, 10, &totals);
+    if (totals.games == 0) {
+        printf("No games logged yet in %s\n", path);
+        return 0;
+    }
+
+    char duration[32];
+    formatDuration(duration, sizeof(duration), totals.durationMillis);
+    printf("Games: %u  Lines: %u  Pieces: %u  Time played: %s  Average score: %llu\n",
+           totals.games, totals.lines, totals.pieces, duration,
+           (unsigned long long)(totals.score / totals.games));
+    printf("\n  #     Score  Level  Lines  Pieces     Time  Board  Date        Seed\n");
+    for (int i = 0; i < found; ++i) {
+        char date[16] = "?";
+        time_t ended = (time_t)best[i].endedAt;
+        struct tm *local = localtime(&ended);
+        if (local) {
+            strftime(date, sizeof(date), "%Y-%m-%d", local);
+        }
+        formatDuration(duration, sizeof(duration), best[i].durationMillis);
+        printf("%3d %9llu %6u %6u %7u %8s %3ux%-3u %-11s %llu\n", i + 1, (unsigned long long)best[i].score,
+               best[i].level, best[i].lines, best[i].pieces, duration, best[i].width, best[i].height, date,
+               (unsigned long long)best[i].seed);
+    }
+    return 0;
+}
+
+/* Note a key for the replay file, if the game is being recorded */
+void recordKey(const Tetris *tetris, int key) {
+    if (versus.game == tetris && key > 0 && key <= 0xff) {
+        versusEvent(&versus, (VersusEvent){.tick = tetris->tick, .key = (uint8_t)key});
+    }
+    if (!recording.path || key == REPLAY_END_KEY || key < 0 || key > 0xff) {
+        return;
+    }
+    if (recording.eventCount == recording.eventCapacity) {
+        size_t capacity = recording.eventCapacity ? recording.eventCapacity * 2 : 1024;
+        ReplayEvent *events = realloc(recording.events, capacity * sizeof(ReplayEvent));
+        if (!events) {
+            return;
+        }
+        recording.events = events;
+        recording.eventCapacity = capacity;
+    }
+    recording.events[recording.eventCount++] = (ReplayEvent){tetris->tick, (uint8_t)key};
+}
+
+static void putVarint(FILE *file, uint64_t value) {
+    while (value >= 0x80) {
+        fputc((int)(value & 0x7f) | 0x80, file);
+        value >>= 7;
+    }
+    fputc((int)value, file);
+}
+
+/*
+  Write the recording: a 16 byte header (magic, version, board size, the
+  randomizer and preview depth sharing a byte, seed) then each key as a
+  varint tick delta and the key byte, closed by an end marker on the last
+  tick played. Runs at exit, and only once.
+*/
+void writeReplay() {
+    if (!recording.path) {
+        return;
+    }
+    FILE *file = fopen(recording.path, "wb");
+    recording.path = NULL;
+    if (!file) {
+        return;
+    }
+    uint8_t header[REPLAY_HEADER_SIZE] = {0};
+    memcpy(header, REPLAY_MAGIC, 4);
+    header[4] = REPLAY_VERSION;
+    header[5] = recording.width;
+    header[6] = recording.height;
+    header[7] = recording.policy | recording.previewDepth << 4;
+    for (int i = 0; i < 8; ++i) {
+        header[8 + i] = (uint8_t)(recording.seed >> (8 * i));
+    }
+    fwrite(header, 1, sizeof(header), file);
+
+    uint64_t tick = 0;
+    for (size_t i = 0; i < recording.eventCount; ++i) {
+        putVarint(file, recording.events[i].tick - tick);
+        fputc(recording.events[i].key, file);
+        tick = recording.events[i].tick;
+    }
+    putVarint(file, recording.game->tick - tick);
+    fputc(REPLAY_END_KEY, file);
+    fclose(file);
+}
+
+bool loadReplay(const char *path, Replay *replay) {
+    long length;
+    char *data = readFile(path, &length);
+    if (!data) {
+        return false;
+    }
+    const uint8_t *bytes = (const uint8_t *)data;
+    *replay = (Replay){.endTick = UINT64_MAX};
+    if (length < REPLAY_HEADER_SIZE || memcmp(bytes, REPLAY_MAGIC, 4) != 0 || bytes[4] != REPLAY_VERSION ||
+        bytes[5] < BOARD_MIN_SIZE || bytes[5] > BOARD_MAX_WIDTH || bytes[6] < BOARD_MIN_SIZE || bytes[6] > BOARD_MAX_HEIGHT ||
+        (bytes[7] & 0xf) > RANDOMIZER_HISTORY || bytes[7] >> 4 < 1 || bytes[7] >> 4 > PREVIEW_MAX) {
+        fprintf(stderr, "%s is not a replay this version can play\n", path);
+        free(data);
+        return false;
+    }
+    replay->width = bytes[5];
+    replay->height = bytes[6];
+    replay->policy = bytes[7] & 0xf;
+    replay->previewDepth = bytes[7] >> 4;
+    for (int i = 0; i < 8; ++i) {
+        replay->seed |= (uint64_t)bytes[8 + i] << (8 * i);
+    }
+
+    // Every event takes at least two bytes
+    replay->events = malloc(((length - REPLAY_HEADER_SIZE) / 2 + 1) * sizeof(ReplayEvent));
+    uint64_t tick = 0;
+    long i = REPLAY_HEADER_SIZE;
+    while (i < length) {
+        uint64_t delta = 0;
+        int shift = 0;
+        while (i < length && (bytes[i] & 0x80) && shift < 63) {
+            delta |= (uint64_t)(bytes[i++] & 0x7f) << shift;
+            shift += 7;
+        }
+        if (i + 1 >= length) {
+            break; // Cut short, play what there is
+        }
+        delta |= (uint64_t)bytes[i++] << shift;
+        tick += delta;
+        uint8_t key = bytes[i++];
+        if (key == REPLAY_END_KEY) {
+            replay->endTick = tick;
+            break;
+        }
+        replay->events[replay->eventCount++] = (ReplayEvent){tick, key};
+    }
+    free(data);
+    return true;
+}
+
+void freeReplay(Replay *replay) {
+    free(replay->events);
+    for (size_t i = 0; i < replay->snapshotCount; ++i) {
+        free(replay->snapshots[i].data);
+    }
+    free(replay->snapshots);
+    *replay = (Replay){0};
+}
+
+/* Keep a snapshot of the game every REPLAY_SNAPSHOT_PIECES pieces as a seek point */
+static void replaySnapshot(Replay *replay, const Tetris *tetris) {
+    if (tetris->pieces != (long)(replay->snapshotCount * REPLAY_SNAPSHOT_PIECES)) {
+        return;
+    }
+    if (replay->snapshotCount == replay->snapshotCapacity) {
+        size_t capacity = replay->snapshotCapacity ? replay->snapshotCapacity * 2 : 16;
+        ReplaySnapshot *snapshots = realloc(replay->snapshots, capacity * sizeof(ReplaySnapshot));
+        if (!snapshots) {
+            return;
+        }
+        replay->snapshots = snapshots;
+        replay->snapshotCapacity = capacity;
+    }
+    uint8_t data[SNAPSHOT_MAX_SIZE];
+    size_t length = saveSnapshot(tetris, data);
+    uint8_t *copy = malloc(length);
+    if (!copy) {
+        return;
+    }
+    memcpy(copy, data, length);
+    replay->snapshots[replay->snapshotCount++] = (ReplaySnapshot){copy, length, tetris->pieces, replay->nextEvent};
+}
+
+/*
+  Play recorded keys and gravity up to a tick, or until a number of pieces
+  have locked (-1 for no limit). Keys land on the same ticks as when they
+  were recorded, so the game plays out exactly as it did.
+*/
+void replayRun(Replay *replay, Tetris *tetris, uint64_t untilTick, long untilPieces) {
+    for (;;) {
+        replaySnapshot(replay, tetris);
+        if (tetris->gameOver || (untilPieces >= 0 && tetris->pieces >= untilPieces)) {
+            return;
+        }
+        uint64_t target = untilTick < replay->endTick ? untilTick : replay->endTick;
+        bool keyDue = replay->nextEvent < replay->eventCount && replay->events[replay->nextEvent].tick <= target;
+        if (keyDue) {
+            target = replay->events[replay->nextEvent].tick;
+        }
+        if (tetris->tick < target && !tetris->paused) {
+            // One gravity or lock step at a time, so a piece limit stops on the right piece
+            uint64_t ticks = target - tetris->tick;
+            uint64_t untilEvent = ticksUntilEvent(tetris);
+            tetris_advance(tetris, ticks < untilEvent ? ticks : untilEvent);
+            continue;
+        }
+        if (!keyDue) {
+            return;
+        }
+        applyKey(tetris, replay->events[replay->nextEvent++].key);
+    }
+}
+
+/* Jump to the moment a number of pieces have locked, from the closest seek point before it */
+void replaySeek(Replay *replay, Tetris *tetris, long piece) {
+    if (piece < 0) {
+        piece = 0;
+    }
+    replaySnapshot(replay, tetris);
+    size_t index = piece / REPLAY_SNAPSHOT_PIECES;
+    if (index >= replay->snapshotCount) {
+        index = replay->snapshotCount - 1;
+    }
+    const ReplaySnapshot *snapshot = &replay->snapshots[index];
+    if ((piece < tetris->pieces || snapshot->pieces > tetris->pieces) && loadSnapshot(tetris, snapshot->data, snapshot->length)) {
+        replay->nextEvent = snapshot->nextEvent;
+    }
+    replayRun(replay, tetris, UINT64_MAX, piece);
+}
+
+static bool replayFinished(const Replay *replay, const Tetris *tetris) {
+    if (tetris->gameOver) {
+        return true;
+    }
+    return replay->nextEvent >= replay->eventCount && (tetris->tick >= replay->endTick || tetris->paused);
+}
+
+/*
+  Play a recording back at wall clock speed. '[' and ']' jump 10 pieces back
+  or forward, 'p' pauses the playback and 'q' stops it.
+*/
+int playReplay(const Options *options) {
+    Replay replay;
+    if (!loadReplay(options->replayPath, &replay)) {
+        return 1;
+    }
+    Tetris tetris;
+    tetris_init(&tetris, replay.seed, replay.width, replay.height, replay.policy, replay.previewDepth);
+    replaySeek(&replay, &tetris, options->seekPiece);
+
+    uint64_t start = getCurrentTimeNanos();
+    uint64_t startTick = tetris.tick;
+    bool stopped = false;
+    while (!stopped && !replayFinished(&replay, &tetris)) {
+        replayRun(&replay, &tetris, startTick + (getCurrentTimeNanos() - start) / TICK_NANOS, -1);
+        draw(&tetris);
+
+        // Sleep until the next recorded key or gravity or lock step
+        uint64_t next = tetris.tick + ticksUntilEvent(&tetris);
+        if (replay.nextEvent < replay.eventCount && replay.events[replay.nextEvent].tick < next) {
+            next = replay.events[replay.nextEvent].tick;
+        }
+        uint64_t due = start + (next - startTick) * TICK_NANOS;
+        uint64_t now = getCurrentTimeNanos();
+        if (!waitForInput(due > now ? (int)((due - now + 999999) / 1000000) : 0)) {
+            continue;
+        }
+
+        int key = _getch();
+        switch (key) {
+            case EOF:
+            case 'q':
+                stopped = true;
+                break;
+            case 'p':
+                drawPausedScreen();
+                do {
+                    key = _getch();
+                } while (key != 'p' && key != 'q' && key != EOF);
+                stopped = key != 'p';
+                break;
+            case '[':
+                replaySeek(&replay, &tetris, tetris.pieces - 10);
+                break;
+            case ']':
+                replaySeek(&replay, &tetris, tetris.pieces + 10);
+                break;
+            case 'g':
+            case 'c':
+            case 't':
+            case 'f':
+            case 'h':
+                applyKey(&tetris, key);
+                break;
+        }
+        start = getCurrentTimeNanos();
+        startTick = tetris.tick;
+    }
+
+    if (tetris.gameOver && !stopped) {
+        drawGameOverScreen(&tetris, tetris.score, tetris.level, tetris.linesCleared);
+        _getch();
+    } else {
+        draw(&tetris);
+    }
+    leaveScreen();
+    freeReplay(&replay);
+    return 0;
+}
+
+static void versusEvent(Versus *v, VersusEvent event) {
+    if (v->outgoingCount == v->outgoingCapacity) {
+        size_t capacity = v->outgoingCapacity ? v->outgoingCapacity * 2 : 64;
+        VersusEvent *events = realloc(v->outgoing, capacity * sizeof(VersusEvent));
+        if (!events) {
+            return;
+        }
+        v->outgoing = events;
+        v->outgoingCapacity = capacity;
+    }
+    v->outgoing[v->outgoingCount++] = event;
+}
+
+#ifdef _WIN32
+int playVersus(const Options *options) {
+    fprintf(stderr, "versus play needs POSIX sockets, it isn't available on Windows yet\n");
+    return 1;
+}
+#else
+static uint8_t *putVersusVarint(uint8_t *out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+/* Send one whole message, waiting for the socket to take all of it */
+static bool versusSend(Versus *v, int type, const uint8_t *payload, size_t length) {
+    uint8_t header[3] = {(uint8_t)type, (uint8_t)length, (uint8_t)(length >> 8)};
+    struct iovec parts[2] = {{header, sizeof(header)}, {(void *)payload, length}};
+    struct msghdr message = {.msg_iov = parts, .msg_iovlen = 2};
+    size_t sent = 0, total = sizeof(header) + length;
+    while (sent < total && !v->peer.closed) {
+        ssize_t count = sendmsg(v->peer.fd, &message, MSG_NOSIGNAL);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            v->peer.closed = true;
+            break;
+        }
+        // Short sends only happen on a full socket buffer, step past what went out
+        sent += count;
+        while (count > 0 && message.msg_iovlen > 0) {
+            size_t step = (size_t)count < message.msg_iov->iov_len ? (size_t)count : message.msg_iov->iov_len;
+            message.msg_iov->iov_base = (uint8_t *)message.msg_iov->iov_base + step;
+            message.msg_iov->iov_len -= step;
+            count -= step;
+            if (message.msg_iov->iov_len == 0) {
+                message.msg_iov++;
+                message.msg_iovlen--;
+            }
+        }
+    }
+    return !v->peer.closed;
+}
+
+/*
+  Send what our game did since the last batch, with the tick it has reached.
+  A batch holds at most VERSUS_BATCH_EVENTS, one that has to stop early only
+  confirms up to its last event and the rest go out next time.
+*/
+static void versusFlush(Versus *v) {
+    uint8_t payload[10 + VERSUS_BATCH_EVENTS * 13];
+    size_t count = v->outgoingCount < VERSUS_BATCH_EVENTS ? v->outgoingCount : VERSUS_BATCH_EVENTS;
+    uint64_t confirmed = count < v->outgoingCount ? v->outgoing[count - 1].tick : v->game->tick;
+    uint8_t *out = putVersusVarint(payload, confirmed);
+    for (size_t i = 0; i < count; ++i) {
+        const VersusEvent *event = &v->outgoing[i];
+        out = putVersusVarint(out, event->tick - v->outgoingEventTick);
+        v->outgoingEventTick = event->tick;
+        *out++ = event->key;
+        if (event->key == VERSUS_GARBAGE) {
+            *out++ = event->rows;
+            *out++ = event->hole;
+        }
+    }
+    versusSend(v, VERSUS_BATCH, payload, out - payload);
+    v->outgoingCount -= count;
+    memmove(v->outgoing, v->outgoing + count, v->outgoingCount * sizeof(VersusEvent));
+    v->sentTick = confirmed;
+}
+
+static bool readVersusVarint(const uint8_t **in, const uint8_t *end, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; *in < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*in)++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Take in the events of one batch, returns false if it doesn't make sense */
+static bool versusBatch(Versus *v, const uint8_t *in, size_t length) {
+    const uint8_t *end = in + length;
+    uint64_t confirmed;
+    if (!readVersusVarint(&in, end, &confirmed) || confirmed < v->remoteTick) {
+        return false;
+    }
+    while (in < end) {
+        uint64_t delta;
+        if (!readVersusVarint(&in, end, &delta) || in == end) {
+            return false;
+        }
+        VersusEvent event = {.tick = v->incomingEventTick + delta, .key = *in++};
+        if (event.key == VERSUS_GARBAGE) {
+            if (end - in < 2) {
+                return false;
+            }
+            event.rows = *in++;
+            event.hole = *in++;
+        }
+        // Events can't go back before what was already confirmed, or past this batch
+        if (event.tick < v->remoteTick || event.tick > confirmed) {
+            return false;
+        }
+        v->incomingEventTick = event.tick;
+        if (v->eventCount == v->eventCapacity) {
+            size_t capacity = v->eventCapacity ? v->eventCapacity * 2 : 64;
+            VersusEvent *events = realloc(v->events, capacity * sizeof(VersusEvent));
+            if (!events) {
+                return false;
+            }
+            v->events = events;
+            v->eventCapacity = capacity;
+        }
+        v->events[v->eventCount++] = event;
+    }
+    if (confirmed > v->remoteTick || v->remoteTickAt == 0) {
+        v->remoteTick = confirmed;
+        v->remoteTickAt = getCurrentTimeNanos();
+    }
+    return true;
+}
+
+/* Read whatever has arrived without blocking, and hand back one whole message at a time */
+static bool inboxMessage(Inbox *inbox, int *type, uint8_t *payload, size_t *length) {
+    while (!inbox->closed) {
+        if (inbox->length >= 3) {
+            size_t size = inbox->data[1] | (size_t)inbox->data[2] << 8;
+            if (inbox->length >= 3 + size) {
+                *type = inbox->data[0];
+                *length = size;
+                memcpy(payload, inbox->data + 3, size);
+                inbox->length -= 3 + size;
+                memmove(inbox->data, inbox->data + 3 + size, inbox->length);
+                return true;
+            }
+        }
+        ssize_t count = recv(inbox->fd, inbox->data + inbox->length, sizeof(inbox->data) - inbox->length, MSG_DONTWAIT);
+        if (count > 0) {
+            inbox->length += count;
+        } else if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            inbox->closed = true; // Closed, or gone
+        } else {
+            return false;
+        }
+    }
+    return false;
+}
+
+/*
+  Play the opponent's confirmed stream into our copy of their game: run to
+  each event's tick, apply it, and stop at the tick they have confirmed.
+*/
+static void versusCatchUp(Versus *v) {
+    Tetris *opponent = &v->opponent;
+    while (!opponent->gameOver) {
+        bool eventDue = v->nextEvent < v->eventCount;
+        uint64_t target = eventDue ? v->events[v->nextEvent].tick : v->remoteTick;
+        if (opponent->tick < target) {
+            tetris_advance(opponent, target - opponent->tick);
+            continue;
+        }
+        if (!eventDue) {
+            break;
+        }
+        const VersusEvent *event = &v->events[v->nextEvent++];
+        if (event->key == VERSUS_GARBAGE) {
+            queueGarbage(opponent, event->rows, event->hole);
+        } else {
+            applyKey(opponent, event->key);
+        }
+    }
+    v->eventCount -= v->nextEvent;
+    memmove(v->events, v->events + v->nextEvent, v->eventCount * sizeof(VersusEvent));
+    v->nextEvent = 0;
+
+    // Their clears land in our queue, with a hole of our choosing that goes out in our stream
+    int rows = opponent->garbageSent - v->garbageSeen;
+    if (rows > 0 && !v->game->gameOver) {
+        int hole = rngBelow(&v->holes, v->game->width);
+        queueGarbage(v->game, rows, hole);
+        versusEvent(v, (VersusEvent){v->game->tick, VERSUS_GARBAGE, rows, hole});
+        v->game->revision++;
+    }
+    v->garbageSeen = opponent->garbageSent;
+}
+
+/* Ticks to run the opponent on past what they have confirmed, to cover the time their next batch takes to arrive */
+static uint64_t versusLead(const Versus *v) {
+    if (v->peer.closed || v->opponent.gameOver) {
+        return 0;
+    }
+    uint64_t ticks = (getCurrentTimeNanos() - v->remoteTickAt) / TICK_NANOS;
+    return ticks < VERSUS_PREDICT_TICKS ? ticks : VERSUS_PREDICT_TICKS;
+}
+
+/* The opponent's well, to the left of ours, with the rows their clears have sent */
+static void drawOpponent(const Tetris *opponent, const Tetris *mine) {
+    int top = renderer.boardTop;
+    int left = renderer.boardLeft - opponent->width - 4;
+    screenPut(top, left, 0x256D, COLOR_DEFAULT);
+    for (int i = 0; i < opponent->width; ++i) screenPut(top, left + 1 + i, 0x2500, COLOR_DEFAULT);
+    screenPut(top, left + opponent->width + 1, 0x256E, COLOR_DEFAULT);
+    screenText(top, left + 1 + (opponent->width - 5) / 2, "RIVAL");
+
+    int step = mine->halfBlock ? 2 : 1;
+    for (int y = 0; y < opponent->height; y += step) {
+        int row = top + 1 + y / step;
+        screenPut(row, left, 0x2502, COLOR_DEFAULT);
+        for (int x = 0; x < opponent->width; ++x) {
+            // Our own color, dots and block settings, their toggles are theirs
+            int color = wellColor(opponent, x, y, false);
+            if (mine->halfBlock) {
+                putHalfCell(row, left + 1 + x, color, y + 1 < opponent->height ? wellColor(opponent, x, y + 1, false) : WELL_EMPTY, mine);
+            } else if (color == WELL_EMPTY) {
+                screenPut(row, left + 1 + x, mine->showDots ? '.' : ' ', COLOR_DEFAULT);
+            } else if (mine->toggleColors) {
+                screenPut(row, left + 1 + x, ' ', color);
+            } else {
+                screenPut(row, left + 1 + x, '#', COLOR_DEFAULT);
+            }
+        }
+        screenPut(row, left + opponent->width + 1, 0x2502, COLOR_DEFAULT);
+    }
+    int bottom = top + (opponent->height + step - 1) / step + 1;
+    screenPut(bottom, left, 0x2570, COLOR_DEFAULT);
+    for (int i = 0; i < opponent->width; ++i) screenPut(bottom, left + 1 + i, 0x2500, COLOR_DEFAULT);
+    screenPut(bottom, left + opponent->width + 1, 0x256F, COLOR_DEFAULT);
+    screenClear(bottom + 1, left, opponent->width + 2);
+    screenText(bottom + 1, left, "Sent: %d", opponent->garbageSent);
+
+    int side = renderer.boardLeft + mine->width + 2;
+    int incoming = 0;
+    for (int i = 0; i < mine->incomingCount; ++i) {
+        incoming += mine->incoming[i].rows;
+    }
+    screenClear(top + 4, side, 20);
+    screenText(top + 4, side, "  Incoming: %d", incoming);
+}
+
+static void drawVersusResult(const Tetris *tetris, const char *result) {
+    const char *resultText[] = {
+        "+---------------+",
+        "|               |",
+        "+---------------+",
+        "| Press any key |",
+        "| to exit       |",
+        "+---------------+"
+    };
+    int lineCount = sizeof(resultText) / sizeof(resultText[0]);
+    int top = renderer.boardTop + (wellRows(tetris) + 2 - lineCount) / 2;
+    int left = renderer.boardLeft + (tetris->width + 2 - (int)strlen(resultText[0])) / 2;
+    if (top < 0) top = 0;
+    if (left < 0) left = 0;
+    for (int i = 0; i < lineCount; ++i) {
+        if (i == 1) {
+            screenText(top + i, left, "| %-13s |", result);
+        } else {
+            screenText(top + i, left, "%s", resultText[i]);
+        }
+    }
+    renderer.composed = false; // The box covers the board
+    presentFrame();
+}
+
+/*
+  Open a listening socket, or connect to one. An address with a '/' is a Unix
+  socket path, otherwise it is HOST:PORT, or just a port on this machine.
+*/
+static int openSocket(const char *address, bool listening) {
+    int fd = -1;
+    if (strchr(address, '/')) {
+        struct sockaddr_un local = {.sun_family = AF_UNIX};
+        if (strlen(address) >= sizeof(local.sun_path)) {
+            fprintf(stderr, "%s is too long for a socket path\n", address);
+            return -1;
+        }
+        strcpy(local.sun_path, address);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            perror("socket");
+            return -1;
+        }
+        if (listening) {
+            unlink(address);
+            if (bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0 || listen(fd, 8) < 0) {
+                perror(address);
+                close(fd);
+                return -1;
+            }
+            return fd;
+        }
+        // The other side may not be listening yet
+        for (int attempt = 0; connect(fd, (struct sockaddr *)&local, sizeof(local)) < 0; ++attempt) {
+            if (attempt == 100) {
+                perror(address);
+                close(fd);
+                return -1;
+            }
+            usleep(100 * 1000);
+        }
+        return fd;
+    }
+
+    char host[256] = "127.0.0.1";
+    const char *port = strrchr(address, ':');
+    if (port) {
+        snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+        port++;
+    } else {
+        port = address;
+    }
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = listening ? AI_PASSIVE : 0};
+    struct addrinfo *found;
+    int error = getaddrinfo(host, port, &hints, &found);
+    if (error != 0) {
+        fprintf(stderr, "%s: %s\n", address, gai_strerror(error));
+        return -1;
+    }
+    for (int attempt = 0; fd < 0 && attempt <= (listening ? 0 : 100); ++attempt) {
+        for (struct addrinfo *candidate = found; candidate && fd < 0; candidate = candidate->ai_next) {
+            fd = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            bool ready = listening ? bind(fd, candidate->ai_addr, candidate->ai_addrlen) == 0 && listen(fd, 8) == 0
+                                   : connect(fd, candidate->ai_addr, candidate->ai_addrlen) == 0;
+            if (!ready) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        if (fd < 0 && !listening) {
+            usleep(100 * 1000);
+        }
+    }
+    freeaddrinfo(found);
+    if (fd < 0) {
+        fprintf(stderr, "%s: can't %s\n", address, listening ? "listen there" : "connect");
+        return -1;
+    }
+    return fd;
+}
+
+/* Wait for the one opponent a versus game needs */
+static int versusOpen(const char *address, bool listening) {
+    int fd = openSocket(address, listening);
+    if (fd < 0 || !listening) {
+        return fd;
+    }
+    printf("Waiting for an opponent on %s\n", address);
+    fflush(stdout);
+    int peer = accept(fd, NULL, NULL);
+    close(fd);
+    if (strchr(address, '/')) {
+        unlink(address);
+    }
+    return peer;
+}
+
+/*
+  The listening side picks the game: it sends the settings, and both play
+  the same pieces from the same seed. The connecting side answers with the
+  same message once it has set up, and both start the clock from there.
+*/
+static bool versusHandshake(Versus *v, const Options *options, Tetris *tetris) {
+    uint8_t hello[REPLAY_HEADER_SIZE] = {0};
+    uint64_t seed = options->seedGiven ? options->seed : (uint64_t)time(0);
+    if (options->versusListen) {
+        memcpy(hello, VERSUS_MAGIC, 4);
+        hello[4] = VERSUS_VERSION;
+        hello[5] = options->width;
+        hello[6] = options->height;
+        hello[7] = options->randomizer | options->preview << 4;
+        for (int i = 0; i < 8; ++i) {
+            hello[8 + i] = (uint8_t)(seed >> (8 * i));
+        }
+        versusSend(v, VERSUS_HELLO, hello, sizeof(hello));
+    }
+
+    uint8_t payload[INBOX_SIZE];
+    size_t length = 0;
+    int type = 0;
+    while (!v->peer.closed && !inboxMessage(&v->peer, &type, payload, &length)) {
+        struct pollfd fd = {v->peer.fd, POLLIN, 0};
+        if (poll(&fd, 1, 30000) == 0) {
+            fprintf(stderr, "the opponent never said hello\n");
+            return false;
+        }
+    }
+    if (v->peer.closed || type != VERSUS_HELLO || length != REPLAY_HEADER_SIZE || memcmp(payload, VERSUS_MAGIC, 4) != 0 ||
+        payload[4] != VERSUS_VERSION || payload[5] < BOARD_MIN_SIZE || payload[5] > BOARD_MAX_WIDTH ||
+        payload[6] < BOARD_MIN_SIZE || payload[6] > BOARD_MAX_HEIGHT || (payload[7] & 0xf) > RANDOMIZER_HISTORY ||
+        payload[7] >> 4 < 1 || payload[7] >> 4 > PREVIEW_MAX) {
+        fprintf(stderr, "the opponent isn't playing a versus game this version knows\n");
+        return false;
+    }
+    if (options->versusConnect) {
+        versusSend(v, VERSUS_HELLO, payload, length);
+    }
+    seed = 0;
+    for (int i = 0; i < 8; ++i) {
+        seed |= (uint64_t)payload[8 + i] << (8 * i);
+    }
+    tetris_init(tetris, seed, payload[5], payload[6], payload[7] & 0xf, payload[7] >> 4);
+    v->opponent = *tetris;
+    // Each side picks its own holes, the stream tells the other which
+    rngSeed(&v->holes, seed + (options->versusListen ? 1 : 2));
+    return !v->peer.closed;
+}
+
+int playVersus(const Options *options) {
+    static Tetris tetris;
+    Versus *v = &versus;
+    v->peer.fd = versusOpen(options->versusListen ? options->versusListen : options->versusConnect, options->versusListen);
+    if (v->peer.fd < 0) {
+        return 1;
+    }
+    // Every batch is small and due now, Unix sockets just ignore this
+    int on = 1;
+    setsockopt(v->peer.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (!versusHandshake(v, options, &tetris)) {
+        close(v->peer.fd);
+        return 1;
+    }
+    tetris.halfBlock = options->halfBlock;
+    v->game = &tetris;
+    v->remoteTickAt = getCurrentTimeNanos();
+    Bot *bot = options->bot ? botCreate(options->botDepth, options->botThreads) : NULL;
+
+    static Tetris predicted;
+    const char *result = NULL;
+    uint8_t payload[INBOX_SIZE];
+    while (!result) {
+        if (!tetris.gameOver) {
+            input(&tetris);
+            if (bot) {
+                botInput(bot, &tetris);
+            }
+            update(&tetris);
+            autoShift(&tetris);
+        } else {
+            while (_kbhit() && _getch() != EOF) {
+                // Our game is over, nothing to do with keys until the result is in
+            }
+        }
+
+        int type;
+        size_t length;
+        while (inboxMessage(&v->peer, &type, payload, &length)) {
+            if (type == VERSUS_BATCH && !versusBatch(v, payload, length)) {
+                v->peer.closed = true; // Can't follow their game any more
+            }
+        }
+        versusCatchUp(v);
+        if (v->outgoingCount > 0 || tetris.tick >= v->sentTick + VERSUS_HEARTBEAT_TICKS ||
+            (tetris.gameOver && v->sentTick < tetris.tick)) {
+            versusFlush(v);
+        }
+
+        // Decided once both ends are known, or one side has outlasted the other
+        bool mineOver = tetris.gameOver, theirsOver = v->opponent.gameOver;
+        uint64_t mine = mineOver ? tetris.tick : UINT64_MAX;
+        uint64_t theirs = theirsOver ? v->opponent.tick : UINT64_MAX;
+        if ((theirsOver && (mineOver || tetris.tick >= theirs)) || (mineOver && v->remoteTick >= mine)) {
+            result = mine > theirs ? "YOU WIN" : mine < theirs ? "YOU LOSE" : "DRAW";
+        } else if (v->peer.closed) {
+            result = "OPPONENT LEFT";
+        }
+
+        predicted = v->opponent;
+        tetris_advance(&predicted, versusLead(v));
+        composeFrame(&tetris);
+        drawOpponent(&predicted, &tetris);
+        presentFrame();
+        if (result) {
+            break;
+        }
+
+        // Sleep until a key, a batch, or something due in either game
+        int timeout = mineOver ? -1 : update(&tetris);
+        int shiftTimeout = mineOver ? -1 : autoShiftDue(&tetris);
+        if (shiftTimeout >= 0 && shiftTimeout < timeout) timeout = shiftTimeout;
+        if (bot && !mineOver) {
+            uint64_t now = getCurrentTimeMillis();
+            int botTimeout = bot->nextKeyTime > now ? (int)(bot->nextKeyTime - now) : 0;
+            if (botTimeout < timeout) timeout = botTimeout;
+        }
+        if (!theirsOver) {
+            int heartbeat = ticksToMillis(&tetris.clock, VERSUS_HEARTBEAT_TICKS);
+            int opponentTimeout = versusLead(v) < VERSUS_PREDICT_TICKS ? ticksToMillis(&tetris.clock, ticksUntilEvent(&predicted)) : -1;
+            if (!mineOver && (timeout < 0 || heartbeat < timeout)) timeout = heartbeat;
+            if (opponentTimeout >= 0 && (timeout < 0 || opponentTimeout < timeout)) timeout = opponentTimeout;
+        }
+        struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {v->peer.fd, POLLIN, 0}};
+        poll(fds, 2, timeout);
+    }
+
+    if (v->sentTick < tetris.tick || v->outgoingCount > 0) {
+        versusFlush(v);
+    }
+    drawVersusResult(&tetris, result);
+    _getch();
+    leaveScreen();
+    close(v->peer.fd);
+    if (bot) {
+        botFree(bot);
+    }
+    free(v->outgoing);
+    free(v->events);
+    versus = (Versus){0};
+    return 0;
+}
+#endif
+
+#ifdef _WIN32
+bool spectateServe(const char *address, const Tetris *tetris) {
+    fprintf(stderr, "spectating needs POSIX sockets, it isn't available on Windows yet\n");
+    return false;
+}
+
+void spectatePublish(const Tetris *tetris) {
+}
+
+int playSpectate(const Options *options) {
+    fprintf(stderr, "spectating needs POSIX sockets, it isn't available on Windows yet\n");
+    return 1;
+}
+#else
+static void spectateCleanup() {
+    if (spectate.path) {
+        unlink(spectate.path);
+    }
+}
+
+bool spectateServe(const char *address, const Tetris *tetris) {
+    spectate.listenFd = openSocket(address, true);
+    if (spectate.listenFd < 0) {
+        return false;
+    }
+    fcntl(spectate.listenFd, F_SETFL, O_NONBLOCK);
+    spectate.game = tetris;
+    if (strchr(address, '/')) {
+        spectate.path = address;
+        atexit(spectateCleanup);
+    }
+    return true;
+}
+
+static void dropViewer(int index) {
+    close(spectate.viewers[index]->fd);
+    free(spectate.viewers[index]);
+    spectate.viewers[index] = spectate.viewers[--spectate.viewerCount];
+}
+
+/* Queue a whole message, or nothing when the viewer is too far behind to take it */
+static bool viewerQueue(Viewer *viewer, int type, const uint8_t *payload, size_t length) {
+    if (viewer->pendingLength + 3 + length > sizeof(viewer->pending)) {
+        return false;
+    }
+    uint8_t *out = viewer->pending + viewer->pendingLength;
+    out[0] = (uint8_t)type;
+    out[1] = (uint8_t)length;
+    out[2] = (uint8_t)(length >> 8);
+    memcpy(out + 3, payload, length);
+    viewer->pendingLength += 3 + length;
+    return true;
+}
+
+/* Give the socket as much as it has room for, false once the viewer has gone */
+static bool viewerFlush(Viewer *viewer) {
+    size_t sent = 0;
+    while (sent < viewer->pendingLength) {
+        ssize_t count = send(viewer->fd, viewer->pending + sent, viewer->pendingLength - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        sent += count;
+    }
+    viewer->pendingLength -= sent;
+    memmove(viewer->pending, viewer->pending + sent, viewer->pendingLength);
+    return true;
+}
+
+/*
+  Encode what changed since the last frame: the flags, counters, falling
+  piece and preview, which are a few bytes, then only the board cells that
+  differ from the board the last frame left, as varint cell indexes and
+  colors, 0 for empty.
+*/
+static size_t spectateDelta(const Tetris *tetris, uint8_t *data) {
+    uint8_t *out = data;
+    *out++ = tetris->gameOver | tetris->paused << 1 | tetris->showGhost << 2 | tetris->toggleColors << 3 | tetris->showDots << 4 |
+             tetris->halfBlock << 5;
+    snapshotVarint(&out, tetris->score);
+    snapshotVarint(&out, tetris->level);
+    snapshotVarint(&out, tetris->linesCleared);
+    snapshotVarint(&out, tetris->pieces);
+    *out++ = tetris->currentTetromino;
+    *out++ = tetris->rotation;
+    snapshotVarint(&out, zigzag(tetris->position.x));
+    snapshotVarint(&out, zigzag(tetris->position.y));
+    *out++ = tetris->randomizer.previewDepth;
+    for (int i = 0; i < tetris->randomizer.previewDepth; ++i) {
+        *out++ = randomizerPeek(&tetris->randomizer, i);
+    }
+
+    static uint8_t cells[3 * BOARD_MAX_WIDTH * BOARD_MAX_HEIGHT];
+    uint8_t *cell = cells;
+    int count = 0;
+    for (int y = 0; y < tetris->height; ++y) {
+        BoardRow occupied = tetris->rows[y];
+        if (occupied == spectate.rows[y] && occupied == 0) {
+            continue;
+        }
+        for (int x = 0; x < tetris->width; ++x) {
+            uint8_t color = occupied >> x & 1 ? tetris->colors[y][x] : 0;
+            if (color == spectate.colors[y][x] && (occupied >> x & 1) == (spectate.rows[y] >> x & 1)) {
+                continue;
+            }
+            snapshotVarint(&cell, y * tetris->width + x);
+            *cell++ = color;
+            spectate.colors[y][x] = color;
+            count++;
+        }
+        spectate.rows[y] = occupied;
+    }
+    snapshotVarint(&out, count);
+    memcpy(out, cells, cell - cells);
+    return out - data + (cell - cells);
+}
+
+/* Send the game as it is now to every viewer: a delta, or a keyframe to those that can't use one */
+void spectatePublish(const Tetris *tetris) {
+    if (spectate.listenFd < 0) {
+        return;
+    }
+    static uint8_t delta[SPECTATE_FRAME_MAX];
+    size_t deltaLength = spectateDelta(tetris, delta);
+    uint8_t keyframe[SNAPSHOT_MAX_SIZE];
+    size_t keyframeLength = 0;
+    for (int i = 0; i < spectate.viewerCount;) {
+        Viewer *viewer = spectate.viewers[i];
+        if (viewer->needsKeyframe) {
+            if (keyframeLength == 0) {
+                keyframeLength = saveSnapshot(tetris, keyframe);
+            }
+            viewer->needsKeyframe = !viewerQueue(viewer, SPECTATE_KEYFRAME, keyframe, keyframeLength);
+        } else if (!viewerQueue(viewer, SPECTATE_DELTA, delta, deltaLength)) {
+            viewer->needsKeyframe = true; // Dropped, the deltas after it mean nothing without a keyframe
+        }
+        if (!viewerFlush(viewer)) {
+            dropViewer(i);
+            continue;
+        }
+        ++i;
+    }
+}
+
+/* The sockets the game loop should wake up for: new viewers, and viewers with output waiting */
+int spectatePollFds(struct pollfd *fds) {
+    if (spectate.listenFd < 0) {
+        return 0;
+    }
+    fds[0] = (struct pollfd){spectate.listenFd, POLLIN, 0};
+    for (int i = 0; i < spectate.viewerCount; ++i) {
+        const Viewer *viewer = spectate.viewers[i];
+        fds[1 + i] = (struct pollfd){viewer->fd, viewer->pendingLength > 0 ? POLLIN | POLLOUT : POLLIN, 0};
+    }
+    return 1 + spectate.viewerCount;
+}
+
+void spectateService(const struct pollfd *fds, int count) {
+    // Last first, dropping one moves the last viewer into its place
+    for (int i = count - 2; i >= 0; --i) {
+        Viewer *viewer = spectate.viewers[i];
+        bool gone = false;
+        if (fds[1 + i].revents & (POLLIN | POLLHUP | POLLERR)) {
+            // Viewers have nothing to say, anything readable is them hanging up
+            uint8_t scratch[256];
+            ssize_t length = recv(viewer->fd, scratch, sizeof(scratch), MSG_DONTWAIT);
+            gone = length == 0 || (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+        }
+        if (gone || ((fds[1 + i].revents & POLLOUT) && !viewerFlush(viewer))) {
+            dropViewer(i);
+        }
+    }
+
+    bool joined = false;
+    int fd;
+    while ((fds[0].revents & POLLIN) && (fd = accept(spectate.listenFd, NULL, NULL)) >= 0) {
+        Viewer *viewer = spectate.viewerCount < SPECTATE_MAX_VIEWERS ? malloc(sizeof(Viewer)) : NULL;
+        if (!viewer) {
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        viewer->fd = fd;
+        viewer->pendingLength = 0;
+        viewer->needsKeyframe = true;
+        spectate.viewers[spectate.viewerCount++] = viewer;
+        joined = true;
+    }
+    if (joined) {
+        spectatePublish(spectate.game); // Show newcomers the game now, even if nothing is moving
+    }
+}
+
+/* Bring a viewer's copy of the game up to date from a delta, false if it doesn't fit the game */
+static bool applySpectateDelta(Tetris *tetris, const uint8_t *data, size_t length) {
+    SnapshotReader reader = {data, length, 0, false};
+    uint8_t flags = readByte(&reader);
+    int score = (int)readVarint(&reader);
+    int level = (int)readVarint(&reader);
+    int linesCleared = (int)readVarint(&reader);
+    long pieces = (long)readVarint(&reader);
+    int piece = readByte(&reader);
+    int rotation = readByte(&reader);
+    int x = readZigzag(&reader);
+    int y = readZigzag(&reader);
+    int previewDepth = readByte(&reader);
+    if (reader.failed || piece > INV_L || rotation > 3 || previewDepth < 1 || previewDepth > PREVIEW_MAX) {
+        return false;
+    }
+    for (int i = 0; i < 4; ++i) {
+        const Point *cell = &PIECE_CELLS[piece][rotation][i];
+        if (x + cell->x < 0 || x + cell->x >= tetris->width || y + cell->y < 0 || y + cell->y >= tetris->height) {
+            return false;
+        }
+    }
+    Randomizer *randomizer = &tetris->randomizer;
+    randomizer->previewDepth = previewDepth;
+    randomizer->previewStart = 0;
+    for (int i = 0; i < previewDepth; ++i) {
+        randomizer->preview[i] = readByte(&reader) & 7;
+    }
+
+    uint64_t count = readVarint(&reader);
+    for (uint64_t i = 0; i < count && !reader.failed; ++i) {
+        uint64_t index = readVarint(&reader);
+        uint8_t color = readByte(&reader);
+        if (index >= (uint64_t)tetris->width * tetris->height || color > GARBAGE_COLOR_INDEX) {
+            return false;
+        }
+        int row = index / tetris->width, column = index % tetris->width;
+        tetris->rows[row] = color ? tetris->rows[row] | (BoardRow)1 << column : tetris->rows[row] & ~((BoardRow)1 << column);
+        tetris->colors[row][column] = color;
+    }
+    if (reader.failed) {
+        return false;
+    }
+    if (count > 0 && pieces == tetris->pieces) {
+        renderer.composed = false; // The board changed without a piece locking, repaint all of it
+    }
+    tetris->gameOver = flags & 1;
+    tetris->paused = flags >> 1 & 1;
+    tetris->showGhost = flags >> 2 & 1;
+    tetris->toggleColors = flags >> 3 & 1;
+    tetris->showDots = flags >> 4 & 1;
+    tetris->halfBlock = flags >> 5 & 1;
+    tetris->score = score;
+    tetris->level = level;
+    tetris->linesCleared = linesCleared;
+    tetris->pieces = pieces;
+    tetris->currentTetromino = piece;
+    recountBoard(tetris);
+    placePiece(tetris, rotation, x, y);
+    return true;
+}
+
+/* Watch a game someone is serving with --spectate-serve, 'q' stops watching */
+int playSpectate(const Options *options) {
+    static Inbox server;
+    static Tetris tetris;
+    static uint8_t payload[INBOX_SIZE];
+    server.fd = openSocket(options->spectate, false);
+    if (server.fd < 0) {
+        return 1;
+    }
+    bool watching = false, stopped = false, broken = false;
+    uint32_t drawnRevision = 0;
+    while (!server.closed && !stopped) {
+        struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {server.fd, POLLIN, 0}};
+        poll(fds, 2, -1);
+        if (fds[0].revents) {
+            int key = _getch();
+            stopped = key == 'q' || key == EOF || (watching && tetris.gameOver);
+        }
+
+        int type;
+        size_t length;
+        bool changed = false;
+        while (inboxMessage(&server, &type, payload, &length)) {
+            if (type == SPECTATE_KEYFRAME) {
+                watching = loadSnapshot(&tetris, payload, length);
+                renderer.composed = false;
+                broken = !watching;
+            } else if (type == SPECTATE_DELTA && watching) {
+                broken = !applySpectateDelta(&tetris, payload, length);
+            }
+            if (broken) {
+                server.closed = true; // The frames after it would be wrong too
+            }
+            changed = true;
+        }
+        if (!watching || (!changed && !windowResized)) {
+            continue;
+        }
+        if (tetris.gameOver) {
+            if (tetris.revision != drawnRevision || windowResized) {
+                drawGameOverScreen(&tetris, tetris.score, tetris.level, tetris.linesCleared);
+            }
+        } else if (tetris.paused) {
+            drawPausedScreen();
+        } else {
+            draw(&tetris);
+        }
+        drawnRevision = tetris.revision;
+    }
+
+    if (server.closed && watching && tetris.gameOver && !stopped) {
+        _getch(); // Leave the final screen up until the viewer is done with it
+    }
+    leaveScreen();
+    close(server.fd);
+    if (broken) {
+        fprintf(stderr, "the game sent a frame this version can't follow\n");
+    } else if (server.closed && !(watching && tetris.gameOver)) {
+        fprintf(stderr, "the game is no longer being served\n");
+    }
+    return broken ? 1 : 0;
+}
+#endif
+
+/* Heuristic weights, from Yiyuan Lee's tuned four feature player */
+#define BOT_HEIGHT_WEIGHT -0.510066
+#define BOT_LINES_WEIGHT 0.760666
+#define BOT_HOLES_WEIGHT -0.35663
+#define BOT_BUMPINESS_WEIGHT -0.184483
+#define BOT_LOST -1e9
+
+static inline bool botFits(const BotBoard *board, Tetromino piece, int rotation, int x, int y) {
+    return rowsFit(board->rows, board->width, board->height, piece, rotation, x, y);
+}
+
+/* Every placement reachable from a piece's position, the way rotate() and tetris_move() would get there */
+static int botMoves(const BotBoard *board, Tetromino piece, int rotation, int x, int y, BotMove *moves) {
+    int count = 0;
+    for (int turns = 0; turns < 4; ++turns) {
+        if (turns > 0) {
+            int next = (rotation + 1) % 4;
+            int kick = 0;
+            while (kick < 5 && !botFits(board, piece, next, x + ROTATION_KICKS[kick], y)) {
+                ++kick;
+            }
+            if (kick == 5) {
+                break; // Stuck, more turns won't change anything
+            }
+            rotation = next;
+            x += ROTATION_KICKS[kick];
+        }
+        int left = x, right = x;
+        while (botFits(board, piece, rotation, left - 1, y)) --left;
+        while (botFits(board, piece, rotation, right + 1, y)) ++right;
+        for (int column = left; column <= right; ++column) {
+            int drop = y;
+            while (botFits(board, piece, rotation, column, drop + 1)) ++drop;
+            moves[count++] = (BotMove){turns, rotation, x, column, drop};
+        }
+    }
+    return count;
+}
+
+/* Lock a piece into a copy of the board and clear lines, returns the lines cleared */
+static int botPlace(const BotBoard *board, BotBoard *result, Tetromino piece, const BotMove *move) {
+    const PieceMask *mask = &PIECE_MASKS[piece][move->rotation];
+    int left = move->x + mask->left;
+    int top = move->y + mask->top;
+    result->width = board->width;
+    result->height = board->height;
+    result->fullRow = board->fullRow;
+    memcpy(result->rows, board->rows, board->height * sizeof(BoardRow));
+
+    int lines = 0;
+    for (int row = 0; row < mask->height; ++row) {
+        int y = top + row;
+        result->rows[y] |= (BoardRow)mask->rows[row] << left;
+        // Only rows the piece touched can have filled up
+        if (result->rows[y] == result->fullRow) {
+            memmove(&result->rows[1], &result->rows[0], y * sizeof(BoardRow));
+            result->rows[0] = 0;
+            lines++;
+        }
+    }
+    return lines;
+}
+
+/* Score a board by aggregate height, holes and bumpiness, all worked out a row at a time */
+static double botEvaluate(const BotBoard *board) {
+    int heights[BOARD_MAX_WIDTH] = {0};
+    BoardRow covered = 0;  // Columns with a block somewhere above
+    int holes = 0;
+    for (int y = 0; y < board->height; ++y) {
+        BoardRow row = board->rows[y];
+        BoardRow tops = row & ~covered;
+        while (tops) {
+            heights[__builtin_ctzll(tops)] = board->height - y;
+            tops &= tops - 1;
+        }
+        holes += __builtin_popcountll(covered & ~row);
+        covered |= row;
+    }
+
+    int aggregate = heights[0], bumpiness = 0;
+    for (int x = 1; x < board->width; ++x) {
+        aggregate += heights[x];
+        bumpiness += abs(heights[x] - heights[x - 1]);
+    }
+    return BOT_HEIGHT_WEIGHT * aggregate + BOT_HOLES_WEIGHT * holes + BOT_BUMPINESS_WEIGHT * bumpiness;
+}
+
+static uint64_t botHash(const BotBoard *board) {
+    uint64_t hash = 0;
+    for (int y = 0; y < board->height; ++y) {
+        hash = (hash ^ board->rows[y]) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+static double botValue(BotSearch *search, const BotBoard *board, const Tetromino *pieces, int known, int depth);
+
+/*
+  Keep the placements that look best straight away, best first, moving them
+  to the front of moves. Returns how many were kept. Ties keep their order so
+  the result doesn't depend on anything but the board.
+*/
+static int botShortlist(const BotBoard *board, Tetromino piece, BotMove *moves, int count, int keep) {
+    if (count <= keep) {
+        return count;
+    }
+    BotMove kept[BOT_BEAM_WIDTH];
+    double keptValues[BOT_BEAM_WIDTH];
+    int length = 0;
+    for (int i = 0; i < count; ++i) {
+        BotBoard next;
+        int lines = botPlace(board, &next, piece, &moves[i]);
+        double value = BOT_LINES_WEIGHT * lines + botEvaluate(&next);
+        int at = length < keep ? length : keep - 1;
+        if (length == keep && value <= keptValues[at]) {
+            continue;
+        }
+        while (at > 0 && keptValues[at - 1] < value) {
+            kept[at] = kept[at - 1];
+            keptValues[at] = keptValues[at - 1];
+            --at;
+        }
+        kept[at] = moves[i];
+        keptValues[at] = value;
+        if (length < keep) length++;
+    }
+    memcpy(moves, kept, length * sizeof(BotMove));
+    return length;
+}
+
+/* Best outcome of placing one piece from where it spawns, then searching on */
+static double botBest(BotSearch *search, const BotBoard *board, Tetromino piece, const Tetromino *pieces, int known, int depth) {
+    int x = board->width / 2 - 2;
+    if (!botFits(board, piece, 0, x, 0)) {
+        return BOT_LOST;
+    }
+    BotMove moves[4 * BOARD_MAX_WIDTH];
+    int count = botMoves(board, piece, 0, x, 0, moves);
+    if (depth > 1) {
+        count = botShortlist(board, piece, moves, count, BOT_BEAM_WIDTH);
+    }
+    double best = BOT_LOST;
+    for (int i = 0; i < count; ++i) {
+        BotBoard next;
+        int lines = botPlace(board, &next, piece, &moves[i]);
+        double value = BOT_LINES_WEIGHT * lines + botValue(search, &next, pieces, known, depth - 1);
+        if (value > best) best = value;
+    }
+    return best;
+}
+
+/*
+  Value of a board with some pieces still to place. Known pieces are searched
+  in order, beyond them every piece is equally likely so they are averaged.
+  Different placements often leave the same board, so results are cached.
+*/
+static double botValue(BotSearch *search, const BotBoard *board, const Tetromino *pieces, int known, int depth) {
+    if (depth == 0) {
+        return botEvaluate(board);
+    }
+    uint64_t hash = botHash(board);
+    BotCacheEntry *entry = &search->cache[(hash ^ depth) & (BOT_CACHE_SIZE - 1)];
+    if (entry->generation == search->generation && entry->hash == hash && entry->depth == depth) {
+        return entry->value;
+    }
+
+    double value = 0;
+    if (known > 0) {
+        value = botBest(search, board, pieces[0], pieces + 1, known - 1, depth);
+    } else {
+        for (int piece = 0; piece < 8; ++piece) {
+            value += botBest(search, board, piece, NULL, 0, depth) / 8;
+        }
+    }
+    *entry = (BotCacheEntry){hash, value, search->generation, depth};
+    return value;
+}
+
+/* A share of the first placements, searched by one thread */
+typedef struct {
+    const Bot *bot;
+    BotSearch *search;
+    const BotBoard *board;
+    Tetromino piece;
+    const Tetromino *known;  // Previewed pieces after this one
+    int knownCount;
+    const BotMove *moves;
+    double *values;
+    int count, first;
+#ifndef _WIN32
+    pthread_t thread;
+#endif
+} BotWorker;
+
+static void *botWorker(void *argument) {
+    BotWorker *worker = argument;
+    for (int i = worker->first; i < worker->count; i += worker->bot->threads) {
+        BotBoard next;
+        int lines = botPlace(worker->board, &next, worker->piece, &worker->moves[i]);
+        worker->values[i] = BOT_LINES_WEIGHT * lines +
+                            botValue(worker->search, &next, worker->known, worker->knownCount, worker->bot->depth - 1);
+    }
+    return NULL;
+}
+
+Bot *botCreate(int depth, int threads) {
+    Bot *bot = calloc(1, sizeof(Bot));
+    bot->depth = depth;
+#ifdef _WIN32
+    bot->threads = 1;
+#else
+    bot->threads = threads < 1 ? 1 : threads > BOT_MAX_THREADS ? BOT_MAX_THREADS : threads;
+#endif
+    bot->searches = calloc(bot->threads, sizeof(BotSearch));
+    bot->plannedPiece = -1;
+    return bot;
+}
+
+void botFree(Bot *bot) {
+    free(bot->searches);
+    free(bot);
+}
+
+/* Search the current game and keep the keys for the best placement of its piece */
+void botPlan(Bot *bot, const Tetris *tetris) {
+    BotBoard board = {.width = tetris->width, .height = tetris->height, .fullRow = tetris->fullRow};
+    memcpy(board.rows, tetris->rows, tetris->height * sizeof(BoardRow));
+
+    BotMove moves[4 * BOARD_MAX_WIDTH];
+    double values[4 * BOARD_MAX_WIDTH];
+    int count = botMoves(&board, tetris->currentTetromino, tetris->rotation, tetris->position.x, tetris->position.y, moves);
+    if (bot->depth > 1) {
+        count = botShortlist(&board, tetris->currentTetromino, moves, count, BOT_BEAM_WIDTH);
+    }
+
+    // Every previewed piece the search reaches is known, the rest get averaged over
+    Tetromino known[PREVIEW_MAX];
+    int knownCount = tetris->randomizer.previewDepth < bot->depth - 1 ? tetris->randomizer.previewDepth : bot->depth - 1;
+    for (int i = 0; i < knownCount; ++i) {
+        known[i] = randomizerPeek(&tetris->randomizer, i);
+    }
+
+    BotWorker workers[BOT_MAX_THREADS];
+    for (int i = 0; i < bot->threads; ++i) {
+        bot->searches[i].generation++;
+        workers[i] = (BotWorker){.bot = bot, .search = &bot->searches[i], .board = &board, .piece = tetris->currentTetromino,
+                                 .known = known, .knownCount = knownCount, .moves = moves, .values = values,
+                                 .count = count, .first = i};
+    }
+#ifndef _WIN32
+    for (int i = 1; i < bot->threads; ++i) {
+        pthread_create(&workers[i].thread, NULL, botWorker, &workers[i]);
+    }
+#endif
+    botWorker(&workers[0]);
+#ifndef _WIN32
+    for (int i = 1; i < bot->threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+#endif
+
+    // The first of equal placements wins, so the choice doesn't depend on the threads
+    int best = 0;
+    for (int i = 1; i < count; ++i) {
+        if (values[i] > values[best]) best = i;
+    }
+
+    bot->keyCount = 0;
+    bot->nextKey = 0;
+    bot->plannedPiece = tetris->pieces;
+    if (count > 0) {
+        const BotMove *move = &moves[best];
+        for (int i = 0; i < move->turns; ++i) {
+            bot->keys[bot->keyCount++] = 'w';
+        }
+        for (int i = 0; i < abs(move->x - move->turnedX); ++i) {
+            bot->keys[bot->keyCount++] = move->x < move->turnedX ? 'a' : 'd';
+        }
+    }
+    bot->keys[bot->keyCount++] = ' ';
+}
+
+/* In a live game, press the bot's next key once it is due, planning each new piece first */
+void botInput(Bot *bot, Tetris *tetris) {
+    uint64_t now = getCurrentTimeMillis();
+    if (tetris->paused || tetris->gameOver || now < bot->nextKeyTime) {
+        return;
+    }
+    if (bot->plannedPiece != tetris->pieces || bot->nextKey == bot->keyCount) {
+        botPlan(bot, tetris);
+    }
+    int key = bot->keys[bot->nextKey++];
+    recordKey(tetris, key);
+    applyKey(tetris, key);
+    bot->nextKeyTime = now + BOT_KEY_MILLIS;
+}
+
+/* Let the bot play, one key per tick */
+void playBot(Tetris *tetris, Bot *bot, long maxPieces) {
+    while (!tetris->gameOver && (maxPieces < 0 || tetris->pieces < maxPieces)) {
+        botPlan(bot, tetris);
+        for (int i = 0; i < bot->keyCount && !tetris->gameOver; ++i) {
+            applyKey(tetris, bot->keys[i]);
+            tetris_tick(tetris);
+        }
+    }
+}
+
+/* Totals over a set of finished games, kept per worker and merged at the end */
+typedef struct {
+    long games;
+    long long score, lines, level, pieces, ticks;
+    int maxScore, maxLines, maxLevel;
+    long maxPieces;
+} BatchStats;
+
+/*
+  Each worker owns a range of game numbers packed as next << 32 | end. It
+  takes games from the front of its own range, and once that is empty it
+  steals the back half of another worker's range.
+*/
+typedef struct BatchWorker {
+    _Alignas(64) _Atomic uint64_t range;
+    BatchStats stats;
+    int index;
+    const Options *options;
+    const char *inputs;
+    long inputLength;
+    struct BatchWorker *workers;
+    int workerCount;
+#ifndef _WIN32
+    pthread_t thread;
+#endif
+} BatchWorker;
+
+static bool takeGame(BatchWorker *worker, uint32_t *game) {
+    uint64_t range = atomic_load(&worker->range);
+    while ((uint32_t)(range >> 32) < (uint32_t)range) {
+        if (atomic_compare_exchange_weak(&worker->range, &range, range + (1ull << 32))) {
+            *game = range >> 32;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool stealGames(BatchWorker *thief, BatchWorker *victim) {
+    uint64_t range = atomic_load(&victim->range);
+    for (;;) {
+        uint32_t next = range >> 32, end = (uint32_t)range;
+        if (next >= end) {
+            return false;
+        }
+        uint32_t middle = next + (end - next) / 2;
+        if (atomic_compare_exchange_weak(&victim->range, &range, (uint64_t)next << 32 | middle)) {
+            atomic_store(&thief->range, (uint64_t)middle << 32 | end);
+            return true;
+        }
+    }
+}
+
+static void addGame(BatchStats *stats, const Tetris *tetris) {
+    stats->games++;
+    stats->score += tetris->score;
+    stats->lines += tetris->linesCleared;
+    stats->level += tetris->level;
+    stats->pieces += tetris->pieces;
+    stats->ticks += tetris->tick;
+    if (tetris->score > stats->maxScore) stats->maxScore = tetris->score;
+    if (tetris->linesCleared > stats->maxLines) stats->maxLines = tetris->linesCleared;
+    if (tetris->level > stats->maxLevel) stats->maxLevel = tetris->level;
+    if (tetris->pieces > stats->maxPieces) stats->maxPieces = tetris->pieces;
+}
+
+static void mergeStats(BatchStats *total, const BatchStats *part) {
+    total->games += part->games;
+    total->score += part->score;
+    total->lines += part->lines;
+    total->level += part->level;
+    total->pieces += part->pieces;
+    total->ticks += part->ticks;
+    if (part->maxScore > total->maxScore) total->maxScore = part->maxScore;
+    if (part->maxLines > total->maxLines) total->maxLines = part->maxLines;
+    if (part->maxLevel > total->maxLevel) total->maxLevel = part->maxLevel;
+    if (part->maxPieces > total->maxPieces) total->maxPieces = part->maxPieces;
+}
+
+static void *batchWorker(void *argument) {
+    BatchWorker *worker = argument;
+    BatchWorker *workers = worker->workers;
+    Tetris tetris;
+    Bot *bot = worker->options->bot ? botCreate(worker->options->botDepth, 1) : NULL; // Games are already spread over the threads
+
+    for (;;) {
+        uint32_t game;
+        while (takeGame(worker, &game)) {
+            uint64_t seed = worker->options->seed + game;
+            tetris_init(&tetris, seed, worker->options->width, worker->options->height,
+                        worker->options->randomizer, worker->options->preview);
+            if (bot) {
+                playBot(&tetris, bot, worker->options->maxPieces);
+            } else if (worker->inputs) {
+                playInputs(&tetris, worker->inputs, worker->inputLength, worker->options->maxPieces);
+                playGravity(&tetris, worker->options->maxPieces);
+            } else {
+                playRandom(&tetris, seed ^ 0xD1B54A32D192ED03ull, worker->options->maxPieces);
+            }
+            addGame(&worker->stats, &tetris);
+        }
+
+        bool stole = false;
+        for (int i = 1; i < worker->workerCount && !stole; ++i) {
+            stole = stealGames(worker, &workers[(worker->index + i) % worker->workerCount]);
+        }
+        if (!stole) {
+            if (bot) {
+                botFree(bot);
+            }
+            return NULL;
+        }
+    }
+}
+
+/*
+  Simulate a batch of games, game n using seed + n. Games are played by the
+  bot, the inputs file or else the random player. Totals do not depend on
+  the number of threads.
+*/
+int runBatch(const Options *options) {
+    char *inputs = NULL;
+    long inputLength = 0;
+    if (options->inputsPath && !(inputs = readFile(options->inputsPath, &inputLength))) {
+        return 1;
+    }
+    if (options->batchGames > UINT32_MAX) {
+        fprintf(stderr, "at most %u games per batch\n", UINT32_MAX);
+        return 2;
+    }
+
+#ifdef _WIN32
+    int threadCount = 1;
+#else
+    int threadCount = options->threads > 0 ? options->threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadCount < 1) threadCount = 1;
+#endif
+    if (threadCount > options->batchGames) threadCount = options->batchGames;
+
+    // Windows' C runtime has no aligned_alloc(), only its own pair
+#ifdef _WIN32
+    BatchWorker *workers = _aligned_malloc(sizeof(BatchWorker) * threadCount, _Alignof(BatchWorker));
+#else
+    BatchWorker *workers = aligned_alloc(_Alignof(BatchWorker), sizeof(BatchWorker) * threadCount);
+#endif
+    if (!workers) {
+        fprintf(stderr, "out of memory for %d batch workers\n", threadCount);
+        free(inputs);
+        return 1;
+    }
+    for (int i = 0; i < threadCount; ++i) {
+        uint64_t begin = options->batchGames * i / threadCount;
+        uint64_t end = options->batchGames * (i + 1) / threadCount;
+        workers[i] = (BatchWorker){
+            .stats = {0}, .index = i, .options = options, .inputs = inputs, .inputLength = inputLength,
+            .workers = workers, .workerCount = threadCount};
+        atomic_init(&workers[i].range, begin << 32 | end);
+    }
+
+    uint64_t start = getCurrentTimeMillis();
+#ifndef _WIN32
+    for (int i = 1; i < threadCount; ++i) {
+        pthread_create(&workers[i].thread, NULL, batchWorker, &workers[i]);
+    }
+#endif
+    batchWorker(&workers[0]);
+
+    BatchStats total = {0};
+    for (int i = 0; i < threadCount; ++i) {
+#ifndef _WIN32
+        if (i > 0) {
+            pthread_join(workers[i].thread, NULL);
+        }
+#endif
+        mergeStats(&total, &workers[i].stats);
+    }
+    uint64_t elapsed = getCurrentTimeMillis() - start;
+    double seconds = elapsed > 0 ? elapsed / 1000.0 : 0.001;
+
+    printf("games=%ld threads=%d elapsed_ms=%llu games_per_sec=%.0f pieces_per_sec=%.0f\n",
+           total.games, threadCount, (unsigned long long)elapsed, total.games / seconds, total.pieces / seconds);
+    printf("score  mean=%.1f max=%d\n", (double)total.score / total.games, total.maxScore);
+    printf("lines  mean=%.2f max=%d\n", (double)total.lines / total.games, total.maxLines);
+    printf("level  mean=%.2f max=%d\n", (double)total.level / total.games, total.maxLevel);
+    printf("pieces mean=%.1f max=%ld total=%lld\n", (double)total.pieces / total.games, total.maxPieces, total.pieces);
+
+#ifdef _WIN32
+    _aligned_free(workers);
+#else
+    free(workers);
+#endif
+    free(inputs);
+    return 0;
+}
+
+/* One timed kernel, run against a prepared game state */
+typedef struct {
+    const char *name;
+    int variant;                               // Passed to prepare, e.g. the number of full lines
+    void (*prepare)(Tetris *tetris, int variant);
+    void (*kernel)(Tetris *tetris);
+    bool restore;                              // The kernel changes the state, start each op from a fresh copy
+} Benchmark;
+
+#define BENCH_WARMUP_SAMPLES 20
+#define BENCH_SAMPLES 200
+#define BENCH_SAMPLE_NANOS 50000  // Aim for samples long enough to hide timer overhead
+
+static volatile int benchSink;  // Keeps results of pure kernels alive
+static const Options *benchOptions;
+static Bot *benchBot;
+
+/* A mid-game board: a ragged stack with holes, plus full rows at the bottom */
+static void benchPrepare(Tetris *tetris, int fullLines) {
+    tetris_init(tetris, 12345, benchOptions->width, benchOptions->height, benchOptions->randomizer, benchOptions->preview);
+    for (int y = tetris->height - 10; y < tetris->height; ++y) {
+        BoardRow row = tetris->fullRow;
+        if (y < tetris->height - fullLines) {
+            row &= ~((BoardRow)1 << rngBelow(&tetris->randomizer.rng, tetris->width));
+            row &= ~((BoardRow)1 << rngBelow(&tetris->randomizer.rng, tetris->width));
+        }
+        tetris->rows[y] = row;
+        for (int x = 0; x < tetris->width; ++x) {
+            tetris->colors[y][x] = (x + y) % 8;
+        }
+    }
+    recountBoard(tetris);
+    tetris->currentTetromino = T;
+    placePiece(tetris, 0, tetris->width / 2 - 2, 2);
+    // As if the last piece landed in the bottom rows, where the full lines are
+    tetris->lockTop = tetris->height - 4;
+    tetris->lockBottom = tetris->height - 1;
+}
+
+static void benchValidPosition(Tetris *tetris) {
+    benchSink += isValidPosition(tetris, tetris->currentPositions);
+}
+
+static void benchPieceFits(Tetris *tetris) {
+    benchSink += pieceFits(tetris, tetris->currentTetromino, tetris->rotation, tetris->position.x, tetris->position.y + 1);
+}
+
+static void benchRotate(Tetris *tetris) {
+    rotate(tetris);
+}
+
+static void benchRemoveFullLines(Tetris *tetris) {
+    removeFullLines(tetris);
+}
+
+static void benchGhost(Tetris *tetris) {
+    updateGhost(tetris);
+}
+
+static void benchSpawn(Tetris *tetris) {
+    spawnTetromino(tetris);
+}
+
+/* The mid-game board, searched this many pieces deep */
+static void benchPrepareBot(Tetris *tetris, int depth) {
+    benchPrepare(tetris, 0);
+    benchBot->depth = depth;
+}
+
+static void benchBotPlan(Tetris *tetris) {
+    botPlan(benchBot, tetris);
+    benchSink += benchBot->keyCount;
+}
+
+static void benchCopy(Tetris *tetris) {
+    benchSink += tetris->score;
+}
+
+static void benchDraw(Tetris *tetris) {
+    renderer.fullRedraw = true;
+    renderer.composed = false;
+    draw(tetris);
+}
+
+static void benchDrawDelta(Tetris *tetris) {
+    // Shuffle the piece so every frame has a little to send
+    tetris_move(tetris, (tetris->tick++ & 1) ? 1 : -1, 0);
+    draw(tetris);
+}
+
+static int compareNanos(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Time one benchmark, returns the mean nanoseconds per op */
+static double runBenchmark(const Benchmark *bench, double baseline) {
+    Tetris prepared, work;
+    bench->prepare(&prepared, bench->variant);
+    work = prepared;
+
+    bench->kernel(&work); // Touch the code and data once before calibrating
+    work = prepared;
+
+    // Find how many ops make a sample of about BENCH_SAMPLE_NANOS
+    long ops = 1;
+    for (;;) {
+        uint64_t start = getCurrentTimeNanos();
+        for (long i = 0; i < ops; ++i) {
+            if (bench->restore) work = prepared;
+            bench->kernel(&work);
+        }
+        if (getCurrentTimeNanos() - start >= BENCH_SAMPLE_NANOS || ops >= (1l << 24)) break;
+        ops *= 2;
+    }
+
+    double samples[BENCH_SAMPLES];
+    for (int s = -BENCH_WARMUP_SAMPLES; s < BENCH_SAMPLES; ++s) {
+        uint64_t start = getCurrentTimeNanos();
+        for (long i = 0; i < ops; ++i) {
+            if (bench->restore) work = prepared;
+            bench->kernel(&work);
+        }
+        double perOp = (double)(getCurrentTimeNanos() - start) / ops - (bench->restore ? baseline : 0);
+        if (s >= 0) {
+            samples[s] = perOp > 0 ? perOp : 0;
+        }
+    }
+
+    double sum = 0;
+    for (int s = 0; s < BENCH_SAMPLES; ++s) sum += samples[s];
+    qsort(samples, BENCH_SAMPLES, sizeof(double), compareNanos);
+    double mean = sum / BENCH_SAMPLES;
+
+    printf("{\"bench\":\"%s\",\"variant\":%d,\"ops_per_sample\":%ld,\"samples\":%d,"
+           "\"mean_ns\":%.2f,\"min_ns\":%.2f,\"p50_ns\":%.2f,\"p99_ns\":%.2f}\n",
+           bench->name, bench->variant, ops, BENCH_SAMPLES, mean,
+           samples[0], samples[BENCH_SAMPLES / 2], samples[BENCH_SAMPLES * 99 / 100]);
+    fflush(stdout);
+    return mean;
+}
+
+/*
+  Time the core kernels and print one JSON object per benchmark. Kernels
+  that change the game state start every op from a fresh copy, and the cost
+  of that copy is measured first and subtracted.
+*/
+int runBenchmarks(const Options *options) {
+    const Benchmark benchmarks[] = {
+        {"copy_state", 0, benchPrepare, benchCopy, true},
+        {"isValidPosition", 0, benchPrepare, benchValidPosition, false},
+        {"pieceFits", 0, benchPrepare, benchPieceFits, false},
+        {"rotate", 0, benchPrepare, benchRotate, false},
+        {"removeFullLines", 0, benchPrepare, benchRemoveFullLines, true},
+        {"removeFullLines", 1, benchPrepare, benchRemoveFullLines, true},
+        {"removeFullLines", 2, benchPrepare, benchRemoveFullLines, true},
+        {"removeFullLines", 3, benchPrepare, benchRemoveFullLines, true},
+        {"removeFullLines", 4, benchPrepare, benchRemoveFullLines, true},
+        {"updateGhost", 0, benchPrepare, benchGhost, false},
+        {"spawnTetromino", 0, benchPrepare, benchSpawn, false},
+        {"draw_full", 0, benchPrepare, benchDraw, false},
+        {"draw_delta", 0, benchPrepare, benchDrawDelta, false},
+        {"botPlan", 1, benchPrepareBot, benchBotPlan, false},
+        {"botPlan", 2, benchPrepareBot, benchBotPlan, false},
+        {"botPlan", 3, benchPrepareBot, benchBotPlan, false},
+    };
+
+    int count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    bool matched = !options->benchFilter;
+    for (int i = 0; i < count && !matched; ++i) {
+        matched = strstr(benchmarks[i].name, options->benchFilter) != NULL;
+    }
+    if (!matched) {
+        fprintf(stderr, "no benchmark matches %s, the benchmarks are:", options->benchFilter);
+        for (int i = 0; i < count; ++i) {
+            if (i == 0 || strcmp(benchmarks[i].name, benchmarks[i - 1].name) != 0) {
+                fprintf(stderr, " %s", benchmarks[i].name);
+            }
+        }
+        fputc('\n', stderr);
+        return 2;
+    }
+
+    frame.discard = true;
+    benchOptions = options;
+    benchBot = botCreate(1, options->botThreads);
+    double baseline = 0;
+    for (int i = 0; i < count; ++i) {
+        const Benchmark *bench = &benchmarks[i];
+        bool isBaseline = bench->kernel == benchCopy;
+        if (!isBaseline && options->benchFilter && !strstr(bench->name, options->benchFilter)) {
+            continue;
+        }
+        double mean = runBenchmark(bench, baseline);
+        if (isBaseline) {
+            baseline = mean;
+        }
+    }
+    botFree(benchBot);
+    return 0;
+}
+
+/*
+  Property checks for the game engine. A byte string drives one game: a
+  header picks the board, randomizer and seed, then every byte is one key,
+  a run of ticks, a garbage batch or a snapshot round trip. After each step
+  the whole state is checked against what the rules say it must be, and the
+  first broken invariant aborts, so libFuzzer, AFL and --check all see it as
+  a crash.
+*/
+#define FUZZ_HEADER 12
+#define FUZZ_MAX_STEPS 65536
+
+static const char *fuzzStepName = "start";
+
+static void fuzzFail(const Tetris *tetris, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "invariant broken after %s at tick %llu, piece %ld: ", fuzzStepName,
+            (unsigned long long)tetris->tick, tetris->pieces);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+    abort();
+}
+
+static int fuzzCells(const Tetris *tetris) {
+    int cells = 0;
+    for (int y = 0; y < tetris->height; ++y) {
+        cells += __builtin_popcountll(tetris->rows[y]);
+    }
+    return cells;
+}
+
+/* Everything that must hold between any two steps of a game */
+static void fuzzCheckState(const Tetris *tetris) {
+    for (int y = 0; y < BOARD_MAX_HEIGHT; ++y) {
+        if (tetris->rows[y] & ~(y < tetris->height ? tetris->fullRow : 0)) {
+            fuzzFail(tetris, "row %d has blocks outside the board", y);
+        }
+    }
+    for (int y = 0; y < tetris->height; ++y) {
+        for (BoardRow blocks = tetris->rows[y]; blocks; blocks &= blocks - 1) {
+            int x = __builtin_ctzll(blocks);
+            if (tetris->colors[y][x] > GARBAGE_COLOR_INDEX) {
+                fuzzFail(tetris, "cell %d,%d has color %d", x, y, tetris->colors[y][x]);
+            }
+        }
+    }
+
+    // The falling piece is its four cells around the origin, whatever way it got there
+    const PieceMask *mask = &PIECE_MASKS[tetris->currentTetromino][tetris->rotation];
+    for (int i = 0; i < 4; ++i) {
+        const Point *cell = &PIECE_CELLS[tetris->currentTetromino][tetris->rotation][i];
+        Point at = tetris->currentPositions[i];
+        if (at.x != tetris->position.x + cell->x || at.y != tetris->position.y + cell->y) {
+            fuzzFail(tetris, "piece cell %d is at %d,%d, apart from its origin", i, at.x, at.y);
+        }
+        int maskX = cell->x - mask->left, maskY = cell->y - mask->top;
+        if (maskX < 0 || maskX >= mask->width || maskY < 0 || maskY >= mask->height || !(mask->rows[maskY] >> maskX & 1)) {
+            fuzzFail(tetris, "piece %d rotation %d cell %d is missing from its mask", tetris->currentTetromino, tetris->rotation, i);
+        }
+        for (int j = 0; j < i; ++j) {
+            if (at.x == tetris->currentPositions[j].x && at.y == tetris->currentPositions[j].y) {
+                fuzzFail(tetris, "piece cells %d and %d are both at %d,%d", j, i, at.x, at.y);
+            }
+        }
+        if (at.x < 0 || at.x >= tetris->width || at.y < 0 || at.y >= tetris->height) {
+            fuzzFail(tetris, "piece cell %d,%d is off the board", at.x, at.y);
+        }
+    }
+    // Only the piece that ended the game may overlap the stack
+    if (!tetris->gameOver && !isValidPosition(tetris, tetris->currentPositions)) {
+        fuzzFail(tetris, "the falling piece overlaps the stack");
+    }
+    if (tetris->rotation < 0 || tetris->rotation > 3 || tetris->lockResets > LOCK_RESETS || tetris->lockTimer > LOCK_DELAY_TICKS) {
+        fuzzFail(tetris, "rotation %d, lock resets %d, lock timer %u", tetris->rotation, tetris->lockResets, tetris->lockTimer);
+    }
+
+    // The cached heights, holes and ghost agree with working them out again
+    BoardRow covered = 0;
+    uint8_t heights[BOARD_MAX_WIDTH] = {0};
+    int holes = 0;
+    for (int y = 0; y < tetris->height; ++y) {
+        for (BoardRow tops = tetris->rows[y] & ~covered; tops; tops &= tops - 1) {
+            heights[__builtin_ctzll(tops)] = tetris->height - y;
+        }
+        holes += __builtin_popcountll(covered & ~tetris->rows[y]);
+        covered |= tetris->rows[y];
+    }
+    if (memcmp(heights, tetris->columnHeights, sizeof(heights)) != 0 || holes != tetris->holes) {
+        fuzzFail(tetris, "cached column heights or holes (%d, recounted %d) are stale", tetris->holes, holes);
+    }
+    int drop = -1;
+    while (pieceFits(tetris, tetris->currentTetromino, tetris->rotation, tetris->position.x, tetris->position.y + drop + 1)) {
+        drop++;
+    }
+    if (drop != tetris->ghostDrop) {
+        fuzzFail(tetris, "ghost drop is %d, the piece can fall %d", tetris->ghostDrop, drop);
+    }
+}
+
+/*
+  The board the way it was kept before the bitboard: a char per cell, '.'
+  when empty, tested and cleared a byte at a time. Every piece that locks
+  goes into it too, and it has to agree with the bitboard on the cells,
+  the full lines and where pieces fit.
+*/
+typedef struct {
+    char cells[BOARD_MAX_HEIGHT][BOARD_MAX_WIDTH];
+} CharBoard;
+
+static CharBoard fuzzCharBoard;
+
+static void charBoardCopy(CharBoard *board, const Tetris *tetris) {
+    for (int y = 0; y < tetris->height; ++y) {
+        for (int x = 0; x < tetris->width; ++x) {
+            board->cells[y][x] = tetris->rows[y] >> x & 1 ? tetris->colors[y][x] : '.';
+        }
+    }
+}
+
+static bool charBoardFits(const CharBoard *board, const Tetris *tetris, const Point *positions) {
+    for (int i = 0; i < 4; ++i) {
+        int x = positions[i].x;
+        int y = positions[i].y;
+        if (x < 0 || x >= tetris->width || y < 0 || y >= tetris->height || board->cells[y][x] != '.') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Lock a piece and clear the full lines, returns how many there were */
+static int charBoardLock(CharBoard *board, const Tetris *tetris, const Point *positions, Tetromino piece) {
+    for (int i = 0; i < 4; ++i) {
+        board->cells[positions[i].y][positions[i].x] = piece;
+    }
+    int lines = 0;
+    for (int y = 0; y < tetris->height; ++y) {
+        bool full = true;
+        for (int x = 0; x < tetris->width && full; ++x) {
+            full = board->cells[y][x] != '.';
+        }
+        if (full) {
+            for (int y2 = y; y2 > 0; --y2) {
+                memcpy(board->cells[y2], board->cells[y2 - 1], tetris->width);
+            }
+            memset(board->cells[0], '.', tetris->width);
+            lines++;
+        }
+    }
+    return lines;
+}
+
+/* The bitboard holds the same cells, and tests the falling piece the same way near where it is */
+static void fuzzCheckCharBoard(const CharBoard *board, const Tetris *tetris) {
+    for (int y = 0; y < tetris->height; ++y) {
+        for (int x = 0; x < tetris->width; ++x) {
+            char cell = tetris->rows[y] >> x & 1 ? tetris->colors[y][x] : '.';
+            if (board->cells[y][x] != cell) {
+                fuzzFail(tetris, "cell %d,%d is %d on the bitboard and %d on the char board", x, y, cell, board->cells[y][x]);
+            }
+        }
+    }
+    int rows[] = {0, tetris->position.y - 1, tetris->position.y, tetris->position.y + tetris->ghostDrop,
+                  tetris->position.y + tetris->ghostDrop + 1};
+    for (int rotation = 0; rotation < 4; ++rotation) {
+        for (int r = 0; r < sizeof(rows) / sizeof(rows[0]); ++r) {
+            for (int x = -2; x <= tetris->width; ++x) {
+                Point positions[4];
+                for (int i = 0; i < 4; ++i) {
+                    const Point *cell = &PIECE_CELLS[tetris->currentTetromino][rotation][i];
+                    positions[i] = (Point){x + cell->x, rows[r] + cell->y};
+                }
+                if (charBoardFits(board, tetris, positions) != pieceFits(tetris, tetris->currentTetromino, rotation, x, rows[r]) ||
+                    charBoardFits(board, tetris, positions) != isValidPosition(tetris, positions)) {
+                    fuzzFail(tetris, "the bitboard and char board disagree whether piece %d rotation %d fits at %d,%d",
+                             tetris->currentTetromino, rotation, x, rows[r]);
+                }
+            }
+        }
+    }
+}
+
+/* The counters a step is checked against, copying the whole game every step would be most of the work */
+typedef struct {
+    long pieces;
+    int linesCleared, score, level, cells, incomingCount;
+    Tetromino piece;
+    Point landing[4]; // Where the falling piece locks if it locks in this step
+} FuzzCounters;
+
+static FuzzCounters fuzzCounters(const Tetris *tetris) {
+    FuzzCounters counters = {.pieces = tetris->pieces, .linesCleared = tetris->linesCleared, .score = tetris->score,
+                             .level = tetris->level, .cells = fuzzCells(tetris), .incomingCount = tetris->incomingCount,
+                             .piece = tetris->currentTetromino};
+    // A piece only locks from where it rests, or from where a hard drop puts it
+    for (int i = 0; i < 4; ++i) {
+        counters.landing[i] = (Point){tetris->currentPositions[i].x, tetris->currentPositions[i].y + tetris->ghostDrop};
+    }
+    return counters;
+}
+
+/* What one step may change: at most one piece locks, and the lines it clears pay what the table says */
+static void fuzzCheckStep(const FuzzCounters *before, const Tetris *after) {
+    long pieces = after->pieces - before->pieces;
+    int lines = after->linesCleared - before->linesCleared;
+    if (pieces < 0 || pieces > 1 || lines < 0 || lines > 4 || (lines > 0 && pieces == 0)) {
+        fuzzFail(after, "%ld pieces locked and %d lines cleared in one step", pieces, lines);
+    }
+    int lineScore[] = {0, 100, 300, 500, 800};
+    int expected = lines > 0 ? (lineScore[lines] + (lines - 1) * 100) * before->level : 0;
+    if (after->score - before->score != expected) {
+        fuzzFail(after, "%d lines scored %d, not %d", lines, after->score - before->score, expected);
+    }
+    int level = before->level + (lines > 0 && after->linesCleared >= before->level * 10);
+    if (after->level != level) {
+        fuzzFail(after, "level went from %d to %d with %d lines", before->level, after->level, lines);
+    }
+    // Without garbage rising, the board gains the piece's four cells and loses the cleared rows
+    bool garbageRose = pieces > 0 && before->incomingCount > 0;
+    int cells = before->cells + 4 * (int)pieces - lines * after->width;
+    if (!garbageRose && !after->gameOver && fuzzCells(after) != cells) {
+        fuzzFail(after, "board has %d cells, expected %d", fuzzCells(after), cells);
+    }
+
+    if (pieces > 0) {
+        int charLines = charBoardLock(&fuzzCharBoard, after, before->landing, before->piece);
+        if (charLines != lines) {
+            fuzzFail(after, "the bitboard cleared %d lines and the char board %d", lines, charLines);
+        }
+        if (garbageRose) {
+            charBoardCopy(&fuzzCharBoard, after); // The char board never knew garbage, start it over
+        }
+        fuzzCheckCharBoard(&fuzzCharBoard, after);
+    }
+}
+
+/* Save the game and load it back, the copy has to save to the same bytes */
+static void fuzzSnapshot(const Tetris *tetris) {
+    static uint8_t saved[SNAPSHOT_MAX_SIZE], again[SNAPSHOT_MAX_SIZE];
+    Tetris loaded;
+    size_t length = saveSnapshot(tetris, saved);
+    if (!loadSnapshot(&loaded, saved, length)) {
+        fuzzFail(tetris, "a %zu byte snapshot of the game doesn't load", length);
+    }
+    if (saveSnapshot(&loaded, again) != length || memcmp(saved, again, length) != 0) {
+        fuzzFail(tetris, "a loaded snapshot saves differently");
+    }
+    fuzzCheckState(&loaded);
+}
+
+static uint8_t fuzzByte(const uint8_t *data, size_t size, size_t *at) {
+    return *at < size ? data[(*at)++] : 0;
+}
+
+/* Play the game a byte string describes, checking it at every step. Returns the steps played */
+long fuzzGame(const uint8_t *data, size_t size) {
+    size_t at = 0;
+    int width = BOARD_MIN_SIZE + fuzzByte(data, size, &at) % (BOARD_MAX_WIDTH - BOARD_MIN_SIZE + 1);
+    int height = BOARD_MIN_SIZE + fuzzByte(data, size, &at) % (BOARD_MAX_HEIGHT - BOARD_MIN_SIZE + 1);
+    RandomizerPolicy policy = fuzzByte(data, size, &at) % 4;
+    int preview = 1 + fuzzByte(data, size, &at) % PREVIEW_MAX;
+    uint64_t seed = 0;
+    for (int i = 0; i < 8; ++i) {
+        seed = seed << 8 | fuzzByte(data, size, &at);
+    }
+
+    Tetris tetris;
+    FuzzCounters before;
+    tetris_init(&tetris, seed, width, height, policy, preview);
+    fuzzStepName = "start";
+    fuzzCheckState(&tetris);
+    charBoardCopy(&fuzzCharBoard, &tetris);
+
+    long steps = 0;
+    while (at < size && !tetris.gameOver && steps < FUZZ_MAX_STEPS) {
+        uint8_t byte = data[at++];
+        int argument = byte >> 3;
+        switch (byte & 7) {
+            case 5:
+                // A run of ticks, checked one at a time
+                fuzzStepName = "a tick";
+                for (int i = 0; i <= argument && !tetris.gameOver; ++i, ++steps) {
+                    before = fuzzCounters(&tetris);
+                    tetris_tick(&tetris);
+                    fuzzCheckStep(&before, &tetris);
+                    fuzzCheckState(&tetris);
+                }
+                continue;
+            case 6:
+                fuzzStepName = "skipping to the next event";
+                before = fuzzCounters(&tetris);
+                tetris_advance(&tetris, ticksUntilEvent(&tetris));
+                break;
+            case 7:
+                before = fuzzCounters(&tetris);
+                if (argument < 16) {
+                    fuzzStepName = "queueing garbage";
+                    queueGarbage(&tetris, 1 + argument % 4, (argument * 7 + (int)steps) % tetris.width);
+                } else if (argument < 28) {
+                    fuzzStepName = "a snapshot";
+                    fuzzSnapshot(&tetris);
+                } else {
+                    fuzzStepName = "a pause";
+                    applyKey(&tetris, 'p');
+                }
+                break;
+            default: {
+                // The keys play the way playInputs() does, one tick each
+                static const char keys[] = "adsw ";
+                static const char *names[] = {"a left shift", "a right shift", "a soft drop", "a rotation", "a hard drop"};
+                fuzzStepName = names[byte & 7];
+                before = fuzzCounters(&tetris);
+                applyKey(&tetris, keys[byte & 7]);
+                if (!tetris.gameOver) {
+                    fuzzCheckStep(&before, &tetris);
+                    fuzzCheckState(&tetris);
+                    before = fuzzCounters(&tetris);
+                    tetris_tick(&tetris);
+                }
+                break;
+            }
+        }
+        fuzzCheckStep(&before, &tetris);
+        fuzzCheckState(&tetris);
+        steps++;
+    }
+    return steps;
+}
+
+#ifdef TETRIS_FUZZ
+/* libFuzzer's entry point, AFL++ takes it too when built with -fsanitize=fuzzer */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    fuzzGame(data, size);
+    return 0;
+}
+#endif
+
+/* Replay one fuzzer input, e.g. a crash it saved, or AFL's @@ file */
+int runFuzzFile(const Options *options) {
+    long length;
+    char *data = readFile(options->fuzzPath, &length);
+    if (!data) {
+        return 1;
+    }
+    long steps = fuzzGame((const uint8_t *)data, length);
+    printf("%s: %ld steps, every invariant held\n", options->fuzzPath, steps);
+    free(data);
+    return 0;
+}
+
+/* Property test: random byte strings from the seed, the same way the fuzzers feed them */
+int runChecks(const Options *options) {
+    static uint8_t data[FUZZ_HEADER + 4096];
+    Rng dice;
+    rngSeed(&dice, options->seed);
+    uint64_t start = getCurrentTimeNanos();
+    long long steps = 0;
+    for (long game = 0; game < options->checkGames; ++game) {
+        size_t size = FUZZ_HEADER + rngBelow(&dice, sizeof(data) - FUZZ_HEADER + 1);
+        for (size_t i = 0; i < size; ++i) {
+            data[i] = rngNext(&dice);
+        }
+        steps += fuzzGame(data, size);
+    }
+    double seconds = (getCurrentTimeNanos() - start) / 1e9;
+    printf("%ld games, %lld steps in %.2f s (%.0f games/s), every invariant held\n",
+           options->checkGames, steps, seconds, options->checkGames / (seconds > 0 ? seconds : 1e-9));
+    return 0;
+}
+
+void drawPausedScreen() {
+    int window_width, window_height;
+    getWindowSize(&window_width, &window_height);
+    int horizontal_padding = window_width > 20 ? (window_width - 20) / 2 : 0;
+    int vertical_padding = window_height > 9 ? (window_height - 9) / 2 : 0;
+
+    const char *pausedText[] = {
+        "####################",
+        "#    GAME PAUSED   #",
+        "# Press 'p' to     #",
+        "# resume the game  #",
+        "####################"
+    };
+
+    beginFrame(window_width, window_height);
+    for (int i = 0; i < sizeof(pausedText) / sizeof(pausedText[0]); ++i) {
+        screenText(vertical_padding + i, horizontal_padding, "%s", pausedText[i]);
+    }
+    presentFrame();
+}
+
+void removeFullLines(Tetris *tetris) {
+    int linesRemoved = 0;
+
+    // Only the rows the last piece landed in can have filled up
+    for (int y = tetris->lockTop; y <= tetris->lockBottom; ++y) {
+        if (tetris->rows[y] == tetris->fullRow) {
+            // Shift everything above down by one row
+            memmove(&tetris->rows[1], &tetris->rows[0], y * sizeof(BoardRow));
+            memmove(tetris->colors[1], tetris->colors[0], y * sizeof(tetris->colors[0]));
+            tetris->rows[0] = 0;
+            linesRemoved++;
+        }
+    }
+
+    if (linesRemoved > 0) {
+        // Every column had a block in each cleared row, so it sinks by the lines
+        // removed, unless its top block went with them and it has to look lower
+        int change = 0;
+        for (int x = 0; x < tetris->width; ++x) {
+            int height = tetris->columnHeights[x] - linesRemoved;
+            while (height > 0 && !(tetris->rows[tetris->height - height] & ((BoardRow)1 << x))) {
+                height--;
+            }
+            change += height - tetris->columnHeights[x];
+            tetris->columnHeights[x] = height;
+        }
+        tetris->holes += change + linesRemoved * tetris->width;
+
+        int lineScore[] = {0, 100, 300, 500, 800};
+        int garbageLines[] = {0, 0, 1, 2, 4}; // What a versus opponent gets for it
+        tetris->garbageSent += garbageLines[linesRemoved];
+        int bonus = (linesRemoved - 1) * 100;
+        tetris->score += (lineScore[linesRemoved] + bonus) * tetris->level;
+        tetris->linesCleared += linesRemoved;
+
+        if (tetris->linesCleared >= tetris->level * 10) {
+            tetris->level++;
+        }
+    }
+}
+
+void spawnTetromino(Tetris *tetris) {
+    tetris->currentTetromino = randomizerTake(&tetris->randomizer);
+    tetris->gravityFraction = 0;
+    tetris->lowestY = -1;
+    placePiece(tetris, 0, tetris->width / 2 - 2, 0);
+}
+
+void drawNextTetromino(Tetromino tetromino, int row, const Tetris *tetris, int screenRow, int screenCol) {
+    for (int i = 0; i < 4; ++i) {
+        const Point *cell = &PIECE_CELLS[tetromino][0][i];
+        if (cell->y != row) {
+            continue;
+        }
+        if (tetris->toggleColors) {
+            screenPut(screenRow, screenCol + cell->x, ' ', tetromino);
+        } else {
+            screenPut(screenRow, screenCol + cell->x, '#', COLOR_DEFAULT);
+        }
+    }
+}
+
+uint64_t getCurrentTimeMillis() {
+#ifdef _WIN32
     LARGE_INTEGER frequency, currentTime;
     QueryPerformanceFrequency(&frequency);
     QueryPerformanceCounter(&currentTime);
@@ -456,38 +4332,24 @@ uint64_t getCurrentTimeMillis() {
 #endif
 }
 
-void drawGameOverScreen(const Tetris *tetris, int score, int level, int linesCleared) {
-    draw(tetris);
-
+uint64_t getCurrentTimeNanos() {
 #ifdef _WIN32
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi);
-    int horizontal_padding = (csbi.srWindow.Right - csbi.srWindow.Left - BOARD_WIDTH) / 2;
-    int vertical_padding = (csbi.srWindow.Bottom - csbi.srWindow.Top - 9) / 2;
+    LARGE_INTEGER frequency, currentTime;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&currentTime);
+    return (uint64_t)((double)currentTime.QuadPart * 1e9 / frequency.QuadPart);
 #else
-    struct winsize w;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-    int horizontal_padding = (w.ws_col - BOARD_WIDTH) / 2;
-    int vertical_padding = (w.ws_row - 9) / 2;
+    struct timespec tspec;
+    clock_gettime(CLOCK_MONOTONIC, &tspec);
+    return tspec.tv_sec * 1000000000ull + tspec.tv_nsec;
 #endif
+}
+
+void drawGameOverScreen(const Tetris *tetris, int score, int level, int linesCleared) {
+    int vertical_padding, horizontal_padding;
+    boardLayout(tetris, &vertical_padding, &horizontal_padding);
 
-    printf("\033[%d;%dH", vertical_padding);
-	
-	#ifdef _WIN32
     const char *gameOverText[] = {
-        " +---------------+", // This looks bad, but it has to work anyways right? Because it's a bug for some reason.
-        "|   GAME OVER   |",
-        "+---------------+",
-        "| Score: 000000 |",
-        "| Level: 01     |",
-        "| Lines: 00     |",
-        "+---------------+",
-        "| Press any key |",
-        "| to exit       |",
-        "+---------------+"
-    };
-	#else
-	const char *gameOverText[] = {
         "+---------------+", 
         "|   GAME OVER   |",
         "+---------------+",
@@ -499,358 +4361,1318 @@ void drawGameOverScreen(const Tetris *tetris, int score, int level, int linesCle
         "| to exit       |",
         "+---------------+"
     };
-	#endif
+    int lineCount = sizeof(gameOverText) / sizeof(gameOverText[0]);
+
+    // Live games also get the best of the score log between the stats and the prompt
+    ScoreRecord best[SCORE_SHOWN];
+    int bestCount = scorePath[0] ? topScores(scorePath, best, SCORE_SHOWN, NULL) : 0;
+    int tableRows = bestCount > 0 ? bestCount + 2 : 0;
+
+    // Center the box over the board, which draw() leaves in the back buffer
+    composeBoard(tetris, vertical_padding, horizontal_padding);
+    int top = vertical_padding + (wellRows(tetris) + 2 - lineCount - tableRows) / 2;
+    int left = horizontal_padding + (tetris->width + 2 - (int)strlen(gameOverText[0])) / 2;
+    // Narrow or short boards are smaller than the box, keep it on screen
+    if (top < 0) top = 0;
+    if (left < 0) left = 0;
+
+    for (int i = 0, row = top; i < lineCount; ++i, ++row) {
+        if (i == 3) {
+            screenText(row, left, "| Score: %06d |", score);
+        } else if (i == 4) {
+            screenText(row, left, "| Level: %02d     |", level);
+        } else if (i == 5) {
+            screenText(row, left, "| Lines: %02d     |", linesCleared);
+        } else {
+            screenText(row, left, "%s", gameOverText[i]);
+        }
+        if (i == 6 && bestCount > 0) {
+            screenText(++row, left, "| Best scores   |");
+            for (int j = 0; j < bestCount; ++j) {
+                // The game that just ended is marked
+                bool current = memcmp(&best[j], &lastScore, sizeof(ScoreRecord)) == 0;
+                screenText(++row, left, "| %d. %8llu %c |", j + 1, (unsigned long long)best[j].score, current ? '*' : ' ');
+            }
+            screenText(++row, left, "%s", gameOverText[6]);
+        }
+    }
+    renderer.composed = false; // The box covers the board
+    presentFrame();
+}
+
+void draw(const Tetris *tetris) {
+    composeFrame(tetris);
+    presentFrame();
+}
+
+/* Bring the back buffer up to date with the game, without sending it */
+void composeFrame(const Tetris *tetris) {
+    int top, left, window_width, window_height;
+    boardLayout(tetris, &top, &left);
+    getWindowSize(&window_width, &window_height);
+
+    const DrawnState *drawn = &renderer.drawn;
+    if (renderer.composed && top == renderer.boardTop && left == renderer.boardLeft &&
+        window_width == drawn->windowCols && window_height == drawn->windowRows &&
+        tetris->width == drawn->width && tetris->height == drawn->height && tetris->halfBlock == drawn->halfBlock) {
+        patchBoard(tetris);
+    } else {
+        composeBoard(tetris, top, left);
+    }
+}
+
+/* Terminal rows the inside of the well takes */
+int wellRows(const Tetris *tetris) {
+    return tetris->halfBlock ? (tetris->height + 1) / 2 : tetris->height;
+}
+
+/* Rows the sidebar needs below the top border, whatever the board height */
+#define SIDEBAR_ROWS 21
+
+/* Center the board and its sidebar in the terminal */
+void boardLayout(const Tetris *tetris, int *top, int *left) {
+    int window_width, window_height;
+    getWindowSize(&window_width, &window_height);
+    int height = wellRows(tetris) + 2 > SIDEBAR_ROWS + 1 ? wellRows(tetris) + 2 : SIDEBAR_ROWS + 1;
+    *top = (window_height - height) / 2;
+    *left = (window_width - (tetris->width + 2)) / 2;
+    // Boards taller or wider than the terminal are pinned to the top left
+    if (*top < 0) *top = 0;
+    if (*left < 0) *left = 0;
+}
+
+/* Compose the bordered board and the sidebar into the back buffer */
+void composeBoard(const Tetris *tetris, int top, int left) {
+    int window_width, window_height;
+    getWindowSize(&window_width, &window_height);
+    beginFrame(window_width, window_height);
+
+    // Draw top border with corners and title
+    screenPut(top, left, 0x256D, COLOR_DEFAULT);
+    for (int i = 0; i < tetris->width; ++i) screenPut(top, left + 1 + i, 0x2500, COLOR_DEFAULT);
+    screenPut(top, left + tetris->width + 1, 0x256E, COLOR_DEFAULT);
+
+    // Calculate the position of the title, taking into account its length
+    const char *title = tetris->width >= 11 ? "T E T R I S" : "TETRIS";
+    int titleLength = strlen(title);
+    screenText(top, left + 1 + (tetris->width - titleLength) / 2, "%s", title);
+
+    renderer.boardTop = top;
+    renderer.boardLeft = left;
+
+    // Draw the Tetris board and borders
+    int step = tetris->halfBlock ? 2 : 1;
+    for (int y = 0; y < tetris->height; y += step) {
+        int row = top + y / step + 1;
+        screenPut(row, left, 0x2502, COLOR_DEFAULT); // Left border
+        for (int x = 0; x < tetris->width; ++x) {
+            drawWellCell(tetris, x, y);
+        }
+        screenPut(row, left + tetris->width + 1, 0x2502, COLOR_DEFAULT); // Right border
+    }
+    drawSidebar(tetris, top + 1, left + tetris->width + 2);
+    drawGhost(tetris);
+    drawPiece(tetris);
+
+    if (tetris->showFrameStats) {
+        drawFrameStats(top + 1, left + tetris->width + 22);
+    }
+
+    // Draw bottom border
+    int bottom = top + wellRows(tetris) + 1;
+    screenPut(bottom, left, 0x2570, COLOR_DEFAULT);
+    for (int i = 0; i < tetris->width; ++i) screenPut(bottom, left + 1 + i, 0x2500, COLOR_DEFAULT);
+    screenPut(bottom, left + tetris->width + 1, 0x256F, COLOR_DEFAULT);
+
+    renderer.drawn.windowCols = window_width;
+    renderer.drawn.windowRows = window_height;
+    renderer.drawn.width = tetris->width;
+    renderer.drawn.height = tetris->height;
+    renderer.drawn.halfBlock = tetris->halfBlock;
+    rememberDrawn(tetris);
+    renderer.composed = true;
+}
+
+/* Repaint only what changed since the last frame; the borders and help text stay as they are */
+void patchBoard(const Tetris *tetris) {
+    frameTimer.frameStart = getCurrentTimeNanos();
+    const DrawnState *drawn = &renderer.drawn;
+    int side = renderer.boardLeft + tetris->width + 2;
+
+    if (tetris->pieces != drawn->pieces || tetris->toggleColors != drawn->toggleColors || tetris->showDots != drawn->showDots) {
+        // A piece locked, and maybe cleared lines, or every cell looks different
+        for (int y = 0; y < tetris->height; y += tetris->halfBlock ? 2 : 1) {
+            for (int x = 0; x < tetris->width; ++x) {
+                drawWellCell(tetris, x, y);
+            }
+        }
+    } else {
+        // Only the cells under the old piece and its ghost need putting back
+        for (int i = 0; i < 4; ++i) {
+            drawWellCell(tetris, drawn->piece[i].x, drawn->piece[i].y);
+            if (drawn->ghostDrop > 0) {
+                drawWellCell(tetris, drawn->piece[i].x, drawn->piece[i].y + drawn->ghostDrop);
+            }
+        }
+    }
+    drawGhost(tetris);
+    drawPiece(tetris);
+
+    bool sidebarChanged = tetris->score != drawn->score || tetris->level != drawn->level ||
+                          tetris->linesCleared != drawn->linesCleared || tetris->toggleColors != drawn->toggleColors ||
+                          tetris->randomizer.previewDepth != drawn->previewDepth;
+    for (int i = 0; !sidebarChanged && i < drawn->previewDepth; ++i) {
+        sidebarChanged = randomizerPeek(&tetris->randomizer, i) != drawn->preview[i];
+    }
+    if (sidebarChanged) {
+        drawSidebarValues(tetris, renderer.boardTop + 1, side);
+    }
+
+    // The stats change every frame while they are shown
+    if (tetris->showFrameStats || drawn->showFrameStats) {
+        for (int i = 0; i < 5; ++i) {
+            screenClear(renderer.boardTop + 1 + i, side + 20, renderer.cols);
+        }
+        if (tetris->showFrameStats) {
+            drawFrameStats(renderer.boardTop + 1, side + 20);
+        }
+    }
+    rememberDrawn(tetris);
+}
+
+void rememberDrawn(const Tetris *tetris) {
+    DrawnState *drawn = &renderer.drawn;
+    drawn->pieces = tetris->pieces;
+    drawn->toggleColors = tetris->toggleColors;
+    drawn->showDots = tetris->showDots;
+    drawn->showFrameStats = tetris->showFrameStats;
+    drawn->score = tetris->score;
+    drawn->level = tetris->level;
+    drawn->linesCleared = tetris->linesCleared;
+    drawn->previewDepth = tetris->randomizer.previewDepth;
+    for (int i = 0; i < drawn->previewDepth; ++i) {
+        drawn->preview[i] = randomizerPeek(&tetris->randomizer, i);
+    }
+    memcpy(drawn->piece, tetris->currentPositions, sizeof(drawn->piece));
+    drawn->ghostDrop = tetris->showGhost ? tetris->ghostDrop : -1;
+}
+
+/* One cell of the well as the locked blocks leave it, without the falling piece */
+void drawWellCell(const Tetris *tetris, int x, int y) {
+    if (tetris->halfBlock) {
+        drawHalfCell(tetris, x, y);
+        return;
+    }
+    int row = renderer.boardTop + 1 + y;
+    int col = renderer.boardLeft + 1 + x;
+    if (tetris->rows[y] >> x & 1) {
+        // Only draw colors if toggleColors is true
+        if (tetris->toggleColors) {
+            screenPut(row, col, ' ', tetris->colors[y][x]);
+        } else {
+            screenPut(row, col, '#', COLOR_DEFAULT);
+        }
+    } else { // Cell is empty
+        screenPut(row, col, tetris->showDots ? '.' : ' ', COLOR_DEFAULT);
+    }
+}
+
+/* The falling piece goes over everything else on the board */
+void drawPiece(const Tetris *tetris) {
+    for (int i = 0; tetris->halfBlock && i < 4; ++i) {
+        drawHalfCell(tetris, tetris->currentPositions[i].x, tetris->currentPositions[i].y);
+    }
+    for (int i = 0; !tetris->halfBlock && i < 4; ++i) {
+        int row = renderer.boardTop + 1 + tetris->currentPositions[i].y;
+        int col = renderer.boardLeft + 1 + tetris->currentPositions[i].x;
+        if (tetris->toggleColors) {
+            screenPut(row, col, ' ', tetris->currentTetromino);
+        } else {
+            screenPut(row, col, '#', COLOR_DEFAULT);
+        }
+    }
+}
+
+/* What a board cell shows once the piece and maybe its ghost are over the stack: a color, WELL_EMPTY or WELL_GHOST */
+int wellColor(const Tetris *tetris, int x, int y, bool ghost) {
+    for (int i = 0; i < 4; ++i) {
+        if (tetris->currentPositions[i].x == x && tetris->currentPositions[i].y == y) {
+            return tetris->currentTetromino;
+        }
+    }
+    if (tetris->rows[y] >> x & 1) {
+        return tetris->colors[y][x];
+    }
+    for (int i = 0; ghost && tetris->showGhost && tetris->ghostDrop >= 0 && i < 4; ++i) {
+        if (tetris->currentPositions[i].x == x && tetris->currentPositions[i].y + tetris->ghostDrop == y) {
+            return WELL_GHOST;
+        }
+    }
+    return WELL_EMPTY;
+}
+
+/*
+  Two board cells stacked in one terminal cell. The upper one colors the
+  foreground of '▀' and the lower one the background, a lone block is a
+  half block on the terminal's background, and two of the same color are a
+  plain colored space like in the normal mode, so a frame sends no more.
+*/
+void putHalfCell(int row, int col, int upper, int lower, const Tetris *look) {
+    // Without colors blocks take the terminal's own foreground, the ghost stays gray to stand apart
+    upper = upper == WELL_GHOST ? GHOST_COLOR_INDEX : upper >= 0 && !look->toggleColors ? COLOR_DEFAULT : upper;
+    lower = lower == WELL_GHOST ? GHOST_COLOR_INDEX : lower >= 0 && !look->toggleColors ? COLOR_DEFAULT : lower;
+    if (upper < 0 && lower < 0) {
+        screenPut(row, col, look->showDots ? '.' : ' ', COLOR_DEFAULT);
+    } else if (lower < 0) {
+        screenPutColors(row, col, 0x2580, upper, COLOR_DEFAULT);
+    } else if (upper < 0) {
+        screenPutColors(row, col, 0x2584, lower, COLOR_DEFAULT);
+    } else if (upper == lower) {
+        if (upper == COLOR_DEFAULT) {
+            screenPutColors(row, col, 0x2588, COLOR_DEFAULT, COLOR_DEFAULT);
+        } else {
+            screenPut(row, col, ' ', upper);
+        }
+    } else if (lower == COLOR_DEFAULT) {
+        screenPutColors(row, col, 0x2584, lower, upper); // The default color only works as a foreground
+    } else {
+        screenPutColors(row, col, 0x2580, upper, lower);
+    }
+}
+
+/* The terminal cell holding board row y and the row it shares it with, piece and ghost included */
+void drawHalfCell(const Tetris *tetris, int x, int y) {
+    int top = y & ~1;
+    int upper = wellColor(tetris, x, top, true);
+    int lower = top + 1 < tetris->height ? wellColor(tetris, x, top + 1, true) : WELL_EMPTY;
+    putHalfCell(renderer.boardTop + 1 + top / 2, renderer.boardLeft + 1 + x, upper, lower, tetris);
+}
+
+/* Score, preview and controls, laid out on their own rows rather than the board's */
+void drawSidebar(const Tetris *tetris, int top, int side) {
+    const char *controls[] = {
+        "A: Move left   C: Toggle color control",
+        "D: Move right  T: Toggle dots visibility",
+        "S: Soft drop   F: Toggle frame stats",
+        "W: Rotate      H: Toggle half blocks",
+        "Space: Hard drop",
+        "G: Toggle ghost pieces",
+        "Q: Quit the game",
+        "P: Pause the game"};
+
+    drawSidebarValues(tetris, top, side);
+    screenText(top + 4, side, "  Next:");
+    screenText(top + 12, side, "  Controls:");
+    for (int i = 0; i < sizeof(controls) / sizeof(controls[0]); ++i) {
+        screenText(top + 13 + i, side, "  %s", controls[i]);
+    }
+}
+
+/* The parts of the sidebar that change during a game, cleared first since numbers can get shorter after a seek */
+void drawSidebarValues(const Tetris *tetris, int top, int side) {
+    for (int i = 0; i < 3; ++i) {
+        screenClear(top + i, side, 20);
+    }
+    screenText(top, side, "  Score: %d", tetris->score);
+    screenText(top + 1, side, "  Level: %d", tetris->level);
+    screenText(top + 2, side, "  Lines: %d", tetris->linesCleared);
+    for (int y = 0; y < 4; ++y) {
+        screenClear(top + 6 + y, side + 2, 5 * PREVIEW_MAX);
+    }
+    for (int i = 0; i < tetris->randomizer.previewDepth; ++i) {
+        Tetromino piece = randomizerPeek(&tetris->randomizer, i);
+        for (int y = 0; y < 4; ++y) {
+            drawNextTetromino(piece, y, tetris, top + 6 + y, side + 2 + 5 * i);
+        }
+    }
+}
+
+/* Draw the landing spot cached by updateGhost() over the composed board */
+void drawGhost(const Tetris *tetris) {
+    if (!tetris->showGhost || tetris->ghostDrop < 0) {
+        return;
+    }
+    for (int i = 0; tetris->halfBlock && i < 4; ++i) {
+        drawHalfCell(tetris, tetris->currentPositions[i].x, tetris->currentPositions[i].y + tetris->ghostDrop);
+    }
+    for (int i = 0; !tetris->halfBlock && i < 4; ++i) {
+        int row = renderer.boardTop + 1 + tetris->currentPositions[i].y + tetris->ghostDrop;
+        int col = renderer.boardLeft + 1 + tetris->currentPositions[i].x;
+        if (tetris->toggleColors) {
+            screenPut(row, col, ' ', GHOST_COLOR_INDEX);
+        } else {
+            screenPut(row, col, '*', COLOR_DEFAULT);
+        }
+    }
+}
+
+/*
+  The Windows console has no resize signal. waitForInput() compares its
+  size with the cached one after every wait and sets windowResized when it
+  changed, and getWindowSize() only asks the console again then.
+*/
+#ifdef _WIN32
+static void consoleSize(int *cols, int *rows) {
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi);
+    *cols = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+    *rows = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+}
+
+/* There is no SIGWINCH on Windows, a console size other than the cached one is the resize */
+static void checkConsoleResized() {
+    int cols, rows;
+    consoleSize(&cols, &rows);
+    if (cols != windowCols || rows != windowRows) {
+        windowResized = 1;
+    }
+}
+#endif
+
+void getWindowSize(int *cols, int *rows) {
+#ifdef _WIN32
+    if (windowResized) {
+        windowResized = 0;
+        consoleSize(&windowCols, &windowRows);
+        renderer.fullRedraw = true;
+    }
+    *cols = windowCols;
+    *rows = windowRows;
+#else
+    if (windowResized) {
+        windowResized = 0;
+        struct winsize w;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1 || w.ws_col == 0) {
+            w.ws_col = 80;
+            w.ws_row = 24;
+        }
+        windowCols = w.ws_col;
+        windowRows = w.ws_row;
+        renderer.fullRedraw = true; // The terminal may have reflowed what was on it
+    }
+    *cols = windowCols;
+    *rows = windowRows;
+#endif
+}
+
+/* Start composing a new frame: clear the back buffer to blank cells */
+void beginFrame(int cols, int rows) {
+    frameTimer.frameStart = getCurrentTimeNanos();
+    if (cols > SCREEN_MAX_COLS) cols = SCREEN_MAX_COLS;
+    if (rows > SCREEN_MAX_ROWS) rows = SCREEN_MAX_ROWS;
+    if (cols != renderer.cols || rows != renderer.rows) {
+        renderer.cols = cols;
+        renderer.rows = rows;
+        renderer.fullRedraw = true;
+    }
+    for (int y = 0; y < rows; ++y) {
+        for (int x = 0; x < cols; ++x) {
+            renderer.back[y][x] = (Cell){' ', COLOR_DEFAULT, COLOR_DEFAULT};
+        }
+        renderer.dirtyRows[y] = true;
+    }
+    renderer.composed = false;
+}
+
+
+/* Cells outside the terminal are clipped */
+void screenPut(int row, int col, uint32_t ch, uint8_t color) {
+    if (row < 0 || row >= renderer.rows || col < 0 || col >= renderer.cols) {
+        return;
+    }
+    renderer.back[row][col] = (Cell){ch, COLOR_DEFAULT, color};
+    renderer.dirtyRows[row] = true;
+}
+
+void screenPutColors(int row, int col, uint32_t ch, uint8_t fg, uint8_t bg) {
+    if (row < 0 || row >= renderer.rows || col < 0 || col >= renderer.cols) {
+        return;
+    }
+    renderer.back[row][col] = (Cell){ch, fg, bg};
+    renderer.dirtyRows[row] = true;
+}
+
+void screenClear(int row, int col, int count) {
+    for (int i = 0; i < count; ++i) {
+        screenPut(row, col + i, ' ', COLOR_DEFAULT);
+    }
+}
+
+/* ASCII text only, drawn with the default color */
+void screenText(int row, int col, const char *fmt, ...) {
+    char text[SCREEN_MAX_COLS + 1];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+
+    for (int i = 0; text[i] != '\0'; ++i) {
+        screenPut(row, col + i, (unsigned char)text[i], COLOR_DEFAULT);
+    }
+}
+
+/* Flush the arena with as few write calls as the terminal accepts */
+void frameFlush() {
+    if (frame.discard) {
+        frame.length = 0;
+        return;
+    }
+    size_t written = 0;
+    while (written < frame.length) {
+#ifdef _WIN32
+        DWORD count;
+        if (!WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), frame.data + written, (DWORD)(frame.length - written), &count, NULL)) {
+            break;
+        }
+#else
+        ssize_t count = write(STDOUT_FILENO, frame.data + written, frame.length - written);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+#endif
+        written += count;
+    }
+    frame.length = 0;
+}
+
+static void frameAppend(const char *bytes, size_t length) {
+    if (frame.length + length > FRAME_BUFFER_SIZE) {
+        frameFlush(); // Never reached by presentFrame(), see FRAME_BUFFER_SIZE
+    }
+    memcpy(frame.data + frame.length, bytes, length);
+    frame.length += length;
+    renderer.frameBytes += length;
+}
+
+static void frameNumber(int value) {
+    char digits[12];
+    int length = 0;
+    do {
+        digits[sizeof(digits) - 1 - length++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    frameAppend(digits + sizeof(digits) - length, length);
+}
+
+static void frameCursorTo(int row, int col) {
+    frameAppend("\033[", 2);
+    frameNumber(row + 1);
+    frameAppend(";", 1);
+    frameNumber(col + 1);
+    frameAppend("H", 1);
+}
+
+static void frameCursorForward(int count) {
+    frameAppend("\033[", 2);
+    frameNumber(count);
+    frameAppend("C", 1);
+}
+
+static void frameCodePoint(uint32_t ch) {
+    char utf8[4];
+    int length;
+    if (ch < 0x80) {
+        utf8[0] = ch;
+        length = 1;
+    } else if (ch < 0x800) {
+        utf8[0] = 0xC0 | (ch >> 6);
+        utf8[1] = 0x80 | (ch & 0x3F);
+        length = 2;
+    } else if (ch < 0x10000) {
+        utf8[0] = 0xE0 | (ch >> 12);
+        utf8[1] = 0x80 | ((ch >> 6) & 0x3F);
+        utf8[2] = 0x80 | (ch & 0x3F);
+        length = 3;
+    } else {
+        utf8[0] = 0xF0 | (ch >> 18);
+        utf8[1] = 0x80 | ((ch >> 12) & 0x3F);
+        utf8[2] = 0x80 | ((ch >> 6) & 0x3F);
+        utf8[3] = 0x80 | (ch & 0x3F);
+        length = 4;
+    }
+    frameAppend(utf8, length);
+}
+
+/* The terminal's 16 colors as xterm draws them, to pick the closest one to a theme color */
+static const uint8_t ANSI_RGB[16][3] = {
+    {0, 0, 0}, {205, 0, 0}, {0, 205, 0}, {205, 205, 0}, {0, 0, 238}, {205, 0, 205}, {0, 205, 205}, {229, 229, 229},
+    {127, 127, 127}, {255, 0, 0}, {0, 255, 0}, {255, 255, 0}, {92, 92, 255}, {255, 0, 255}, {0, 255, 255}, {255, 255, 255}
+};
+
+static const uint8_t CUBE_LEVELS[6] = {0, 95, 135, 175, 215, 255};
+
+static void xtermRgb(int index, uint8_t rgb[3]) {
+    if (index < 16) {
+        memcpy(rgb, ANSI_RGB[index], 3);
+    } else if (index < 232) {
+        index -= 16;
+        rgb[0] = CUBE_LEVELS[index / 36];
+        rgb[1] = CUBE_LEVELS[index / 6 % 6];
+        rgb[2] = CUBE_LEVELS[index % 6];
+    } else {
+        rgb[0] = rgb[1] = rgb[2] = 8 + 10 * (index - 232);
+    }
+}
+
+static int colorDistance(const uint8_t a[3], const uint8_t b[3]) {
+    int dr = a[0] - b[0], dg = a[1] - b[1], db = a[2] - b[2];
+    return dr * dr + dg * dg + db * db;
+}
+
+/* The closest of the first count xterm colors, 16 or 256 */
+static int nearestXterm(const uint8_t rgb[3], int count) {
+    int best = 0, bestDistance = INT32_MAX;
+    for (int i = 0; i < count; ++i) {
+        uint8_t candidate[3];
+        xtermRgb(i, candidate);
+        int distance = colorDistance(rgb, candidate);
+        if (distance < bestDistance) {
+            best = i;
+            bestDistance = distance;
+        }
+    }
+    return best;
+}
+
+/* The SGR parameters that set one palette entry as a foreground (30s) or background (40s) */
+static int colorParams(const ThemeColor *color, bool background, ColorDepth depth, char *out, size_t size) {
+    int layer = background ? 40 : 30;
+    uint8_t rgb[3] = {color->r, color->g, color->b};
+    int index = color->index;
+    if (color->rgb && depth == COLOR_DEPTH_TRUE) {
+        return snprintf(out, size, "%d;2;%d;%d;%d", layer + 8, rgb[0], rgb[1], rgb[2]);
+    }
+    if (color->rgb) {
+        index = nearestXterm(rgb, depth == COLOR_DEPTH_256 ? 256 : 16);
+    } else if (index >= 16 && depth == COLOR_DEPTH_16) {
+        xtermRgb(index, rgb);
+        index = nearestXterm(rgb, 16);
+    }
+    if (index >= 16) {
+        return snprintf(out, size, "%d;5;%d", layer + 8, index);
+    }
+    return snprintf(out, size, "%d", index < 8 ? layer + index : layer + 60 + index - 8);
+}
+
+/* Store an escape sequence once, however many entries use it */
+static Sgr paletteIntern(const char *bytes, size_t length) {
+    for (size_t offset = 0; offset + length <= palette.arenaLength; ++offset) {
+        if (memcmp(palette.arena + offset, bytes, length) == 0) {
+            return (Sgr){(uint16_t)offset, (uint16_t)length};
+        }
+    }
+    if (palette.arenaLength + length > sizeof(palette.arena)) {
+        return (Sgr){0, 0}; // Can't happen with PALETTE_SIZE entries, draw uncolored rather than overflow
+    }
+    Sgr sgr = {(uint16_t)palette.arenaLength, (uint16_t)length};
+    memcpy(palette.arena + palette.arenaLength, bytes, length);
+    palette.arenaLength += length;
+    return sgr;
+}
+
+/* Work out every sequence the renderer can need for the theme at this depth */
+void buildPalette(ColorDepth depth) {
+    char fgParams[PALETTE_SIZE][32], bgParams[PALETTE_SIZE][32];
+    strcpy(fgParams[COLOR_DEFAULT], "39");
+    strcpy(bgParams[COLOR_DEFAULT], "49");
+    for (int i = 0; i < PALETTE_SIZE - 1; ++i) {
+        colorParams(&palette.theme[i], false, depth, fgParams[i], sizeof(fgParams[i]));
+        colorParams(&palette.theme[i], true, depth, bgParams[i], sizeof(bgParams[i]));
+    }
+
+    palette.depth = depth;
+    palette.arenaLength = 0;
+    char sequence[80];
+    for (int i = 0; i < PALETTE_SIZE; ++i) {
+        palette.fg[i] = paletteIntern(sequence, snprintf(sequence, sizeof(sequence), "\033[%sm", fgParams[i]));
+        palette.bg[i] = paletteIntern(sequence, snprintf(sequence, sizeof(sequence), "\033[%sm", bgParams[i]));
+    }
+    for (int fg = 0; fg < PALETTE_SIZE; ++fg) {
+        for (int bg = 0; bg < PALETTE_SIZE; ++bg) {
+            int length = fg == COLOR_DEFAULT && bg == COLOR_DEFAULT
+                             ? snprintf(sequence, sizeof(sequence), "\033[0m") // A plain reset is shortest
+                             : snprintf(sequence, sizeof(sequence), "\033[%s;%sm", fgParams[fg], bgParams[bg]);
+            palette.pair[fg][bg] = paletteIntern(sequence, length);
+        }
+    }
+    palette.ready = true;
+}
 
-    for (int i = 0; i < sizeof(gameOverText) / sizeof(gameOverText[0]); ++i) {
-        for (int j = 0; j < horizontal_padding - BOARD_WIDTH; ++j) {
-            putchar(' ');
-        }
+/* COLORTERM names 24-bit terminals, TERM the ones with 256 colors */
+ColorDepth detectColorDepth() {
+    const char *colorterm = getenv("COLORTERM");
+    const char *term = getenv("TERM");
+    if (colorterm && (strcmp(colorterm, "truecolor") == 0 || strcmp(colorterm, "24bit") == 0)) {
+        return COLOR_DEPTH_TRUE;
+    }
+    if (term && strstr(term, "256color")) {
+        return COLOR_DEPTH_256;
+    }
+    return COLOR_DEPTH_16;
+}
 
-        if (i == 3) {
-            printf("| Score: %06d |", score);
-        } else if (i == 4) {
-            printf("| Level: %02d     |", level);
-        } else if (i == 5) {
-            printf("| Lines: %02d     |", linesCleared);
+/*
+  Read a theme: one "name = color" per line, where the name is a piece
+  (I, J, L, O, S, T, Z, INV_L) or ghost, which garbage shares, and the color
+  is #rrggbb or a terminal color number, 0-15 for its own or up to 255.
+  Blank lines and lines starting with ';' or '#' are skipped. Colors the
+  theme leaves out keep their defaults.
+*/
+bool loadTheme(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    char line[256];
+    for (int number = 1; fgets(line, sizeof(line), file); ++number) {
+        char name[32], value[32];
+        char *start = line + strspn(line, " \t");
+        if (*start == '\0' || *start == '\n' || *start == '\r' || *start == ';' || *start == '#') {
+            continue;
+        }
+        int entry = -1;
+        if (sscanf(start, " %31[A-Za-z_] = %31s", name, value) == 2) {
+            for (int i = 0; i < PALETTE_SIZE - 1; ++i) {
+                if (strcmp(name, THEME_NAMES[i]) == 0) {
+                    entry = i;
+                }
+            }
+        }
+        unsigned r, g, b, index;
+        char rest;
+        ThemeColor color = {0};
+        if (entry >= 0 && strlen(value) == 7 && sscanf(value, "#%2x%2x%2x%c", &r, &g, &b, &rest) == 3) {
+            color = (ThemeColor){.rgb = true, .r = r, .g = g, .b = b};
+        } else if (entry >= 0 && sscanf(value, "%u%c", &index, &rest) == 1 && index < 256) {
+            color = (ThemeColor){.index = index};
         } else {
-            printf("%s", gameOverText[i]);
+            fprintf(stderr, "%s:%d: expected a piece name or ghost, '=' and #rrggbb or a color number\n", path, number);
+            fclose(file);
+            return false;
         }
-        printf("\033[E"); 
+        palette.theme[entry] = color;
     }
+    fclose(file);
+    return true;
 }
 
-void draw(const Tetris *tetris) {
-#ifdef _WIN32
-    HANDLE consoleHandle = GetStdHandle(STD_OUTPUT_HANDLE);
-    CHAR_INFO consoleBuffer[BOARD_HEIGHT][BOARD_WIDTH];
+/* The theme --theme names or ~/.tetris.theme if there is one, at the depth asked for or detected */
+bool setupPalette(const Options *options) {
+    for (int i = 0; i < PALETTE_SIZE - 1; ++i) {
+        palette.theme[i] = (ThemeColor){.index = DEFAULT_THEME[i]};
+    }
+    char path[4096];
+    const char *themePath = options->themePath;
+    if (!themePath && homeFile(".tetris.theme", path, sizeof(path)) && access(path, R_OK) == 0) {
+        themePath = path;
+    }
+    if (themePath && !loadTheme(themePath)) {
+        return false;
+    }
+    buildPalette(options->colorDepth >= 0 ? (ColorDepth)options->colorDepth : detectColorDepth());
+    return true;
+}
 
-    for (int y = 0; y < BOARD_HEIGHT; y++) {
-        for (int x = 0; x < BOARD_WIDTH; x++) {
-            consoleBuffer[y][x].Char.AsciiChar = tetris->board[y][x];
-            consoleBuffer[y][x].Attributes = BACKGROUND_BLUE | BACKGROUND_RED | BACKGROUND_INTENSITY;;
+/*
+  Write the difference between the back and front buffers to the terminal.
+  Changed cells are written in runs; the cursor only jumps across unchanged
+  cells and color escapes are only sent when the color actually changes.
+*/
+void presentFrame() {
+    if (!palette.ready) {
+        // Benchmarks and the like draw without setupPalette(), give them the default theme
+        for (int i = 0; i < PALETTE_SIZE - 1; ++i) {
+            palette.theme[i] = (ThemeColor){.index = DEFAULT_THEME[i]};
         }
+        buildPalette(COLOR_DEPTH_16);
     }
-		printf("\033[?25l");
-#else
-        printf("\033[?25l"); // Hide the cursor in Unix
-        printf("\033[H");   // Reset the cursor position to top left.
-#endif
-
-#ifdef _WIN32
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi);
-    int horizontal_padding = (csbi.srWindow.Right - csbi.srWindow.Left + 1 - BOARD_WIDTH) / 2;
-    int vertical_padding = (csbi.srWindow.Bottom - csbi.srWindow.Top + 1 - BOARD_HEIGHT) / 2;
-    int window_width = csbi.srWindow.Right - csbi.srWindow.Left + 1;
-    int window_height = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
-#else
-    struct winsize w;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-    int horizontal_padding = (w.ws_col - (BOARD_WIDTH + 1)) / 2; // Adjust the padding calculation
-    int vertical_padding = (w.ws_row - BOARD_HEIGHT) / 2;
-    int window_width = w.ws_col;
-    int window_height = w.ws_row;
-#endif
+    renderer.frameBytes = 0;
 
-// Calculate the length of the title string
-int titleLength = strlen("T E T R I S");
-	
-    // Draw top border with corners and title
-    printf("\033[%d;%dH\u256D", vertical_padding, horizontal_padding); // Position to the left padding plus vertical padding
-    for (int i = 0; i < BOARD_WIDTH; ++i) printf("\u2500");
-    printf("\u256E\n");  // Top-right corner
-	
+    if (renderer.fullRedraw) {
+        frameAppend("\033[?25l\033[0m\033[H\033[2J", 17); // Hide cursor and clear the screen
+        for (int y = 0; y < renderer.rows; ++y) {
+            for (int x = 0; x < renderer.cols; ++x) {
+                renderer.front[y][x] = (Cell){' ', COLOR_DEFAULT, COLOR_DEFAULT};
+            }
+            renderer.dirtyRows[y] = true;
+        }
+        renderer.fullRedraw = false;
+    }
 
-// Calculate the position of the title, taking into account its length
-int titlePosition = horizontal_padding + (BOARD_WIDTH - titleLength) / 2;
+    int cursorRow = -1, cursorCol = -1;
+    uint8_t penFg = COLOR_DEFAULT, penBg = COLOR_DEFAULT;
 
-// Print the title on a separate line above the game board
-printf("\033[%d;%dH", vertical_padding, titlePosition); // Position for title
-printf("T E T R I S\n");
+    for (int y = 0; y < renderer.rows; ++y) {
+        if (!renderer.dirtyRows[y]) {
+            continue;
+        }
+        renderer.dirtyRows[y] = false;
+        for (int x = 0; x < renderer.cols; ++x) {
+            Cell cell = renderer.back[y][x];
+            Cell *old = &renderer.front[y][x];
+            if (cell.ch == old->ch && cell.fg == old->fg && cell.bg == old->bg) {
+                continue;
+            }
 
-    // Draw the Tetris board and borders
-    for (int y = 0; y < BOARD_HEIGHT; ++y) {
-        printf("\033[%d;%dH\u2502", vertical_padding + y + 1, horizontal_padding); // Left border
-        for (int x = 0; x < BOARD_WIDTH; ++x) {
-            bool isCurrentTetromino = false;
-            bool isGhostTetromino = false;
-
-            if (tetris->showGhost) {
-                Point ghostPositions[4];
-                memcpy(ghostPositions, tetris->currentPositions, sizeof(Point) * 4);
-
-                while (isValidPosition(tetris, ghostPositions)) {
-                    for (int i = 0; i < 4; ++i) {
-                        ghostPositions[i].y++;
-                    }
+            if (cursorRow != y) {
+                frameCursorTo(y, x);
+            } else if (cursorCol != x) {
+                // Rewriting a short gap of unchanged cells in the current color
+                // is cheaper than a cursor jump, if its glyphs are fewer bytes
+                int jump = x - cursorCol < 10 ? 4 : 5;
+                int bytes = 0;
+                for (int i = cursorCol; bytes < jump && i < x; ++i) {
+                    const Cell *gap = &renderer.front[y][i];
+                    bytes += gap->fg != penFg || gap->bg != penBg ? jump : gap->ch < 0x80 ? 1 : gap->ch < 0x800 ? 2 : 3;
                 }
-
-                for (int i = 0; i < 4; ++i) {
-                    ghostPositions[i].y--;
-
-                    if (ghostPositions[i].x == x && ghostPositions[i].y == y) {
-                        isGhostTetromino = true;
-                        break;
+                if (bytes < jump) {
+                    for (int i = cursorCol; i < x; ++i) {
+                        frameCodePoint(renderer.front[y][i].ch);
                     }
+                } else {
+                    frameCursorForward(x - cursorCol);
                 }
             }
-
-            for (int i = 0; i < 4; ++i) {
-                if (tetris->currentPositions[i].x == x && tetris->currentPositions[i].y == y) {
-                    isCurrentTetromino = true;
-                    break;
-                }
-            }
-
-        // Only draw colors if toggleColors is true
-            if (tetris->toggleColors) {
-                if (isCurrentTetromino) {
-                    printf("%s ", TETRIS_COLORS[tetris->currentTetromino]);
-                } else if (isGhostTetromino) {
-                    printf("%s ", TETRIS_COLORS[GHOST_COLOR_INDEX]);
-                } else if (tetris->board[y][x] >= 0 && tetris->board[y][x] <= 7) {
-                    printf("%s ", TETRIS_COLORS[tetris->board[y][x]]);
-                } else if (tetris->board[y][x] >= -7 && tetris->board[y][x] < 0) {
-                    printf("%s ", TETRIS_COLORS[-tetris->board[y][x]]);
-                } else { // Cell is empty
-                    // Modify this else block to control dot visibility
-                    if(tetris->showDots) {
-                        putchar('.'); // Show dot
-                    } else {
-                        putchar(' '); // Hide dot (print space)
-                    }                    
-                }
-                printf("\033[0m");  // Reset color after drawing each cell
-            } else {
-                // When not using color, draw the pieces and control dot visibility
-                if (isCurrentTetromino || (tetris->board[y][x] >= -7 && tetris->board[y][x] <= 7)) {
-                    putchar('#');
-                    } else if (isGhostTetromino) {
-                    putchar('*');
-                } else { // Cell is empty
-                    // Modify this else block to control dot visibility
-                    if(tetris->showDots) {
-                        putchar('.'); // Show dot
-                    } else {
-                        putchar(' '); // Hide dot (print space)
-                    }                    
-                }
+            if (cell.fg != penFg || cell.bg != penBg) {
+                // Back to plain is one short reset, otherwise only the half that changed, or both in one sequence
+                Sgr sgr = cell.fg == COLOR_DEFAULT && cell.bg == COLOR_DEFAULT ? palette.pair[COLOR_DEFAULT][COLOR_DEFAULT]
+                          : cell.fg != penFg && cell.bg != penBg ? palette.pair[cell.fg][cell.bg]
+                          : cell.fg != penFg ? palette.fg[cell.fg]
+                          : palette.bg[cell.bg];
+                frameAppend(palette.arena + sgr.offset, sgr.length);
+                penFg = cell.fg;
+                penBg = cell.bg;
             }
+            frameCodePoint(cell.ch);
+            *old = cell;
+            cursorRow = y;
+            cursorCol = x + 1;
         }
+    }
 
-            
-        printf("\u2502"); // Vertical line at the end of the board row
-        
-        if (y == 0) {
-            printf("  Score: %d", tetris->score);
-        } else if (y == 1) {
-            printf("  Level: %d", tetris->level);
-        } else if (y == 2) {
-            printf("  Lines: %d", tetris->linesCleared);
-        } else if (y == 4) {
-            printf("  Next:");
-        } else if (y >= 6 && y < 10) {
-            printf("  ");
-            drawNextTetromino(tetris->nextTetromino, y - 6, tetris);
-        } else if (y == 12) {
-            printf("  Controls:");
-        } else if (y >= 13 && y <= 17) {
-            const char *controls[] = {
-                "A: Move left   C: Toggle color control",
-                "D: Move right  T: Toggle dots visibility",
-                "S: Soft drop",
-                "W: Rotate",
-                "Space: Hard drop"};
-            printf("  %s", controls[y - 13]);
-        } else if (y == 18) {
-            printf("  G: Toggle ghost pieces");
-        } else if (y == 19) {
-            printf("  Q: Quit the game");
-        } else if (y == 20) {
-            printf("  P: Pause the game");
-        }
-        putchar('\n');
+    if (penFg != COLOR_DEFAULT || penBg != COLOR_DEFAULT) {
+        frameAppend("\033[0m", 4);
     }
-    // Draw bottom border
-    printf("\033[%d;%dH\u2570", vertical_padding + BOARD_HEIGHT + 1, horizontal_padding); // Position to the left bottom corner plus vertical padding
-    for (int i = 0; i < BOARD_WIDTH; ++i) printf("\u2500");
-    printf("\u256F\n");  // Bottom-right corner
+    frameFlush();
 
-    printf("\033[0m"); // Reset colors and styles
+    renderer.lastFrameBytes = renderer.frameBytes;
+    renderer.totalBytes += renderer.frameBytes;
+    renderer.frames++;
+    recordFrame();
+}
 
-    // Reset color to default after drawing the border
-#ifdef _WIN32
-    SetConsoleTextAttribute(consoleHandle, 7); // Resets to default color
-#else
-    printf("\033[0m"); // Resets to default color on UNIX systems
-#endif
+static uint32_t elapsedMicros(uint64_t from, uint64_t to) {
+    return from && to > from ? (uint32_t)((to - from) / 1000) : 0;
 }
 
-void input(Tetris *tetris) {
-    if (_kbhit()) {
-        char key = _getch();
-        if(tetris->paused && key != 'p') // If game is paused and key pressed is not 'p', return immediately
-          return;
-        switch (key) {
-            case 'a':
-                tetris_move(tetris, -1, 0);
-                break;
-            case 'd':
-                tetris_move(tetris, 1, 0);
-                break;
-            case 's':
-                tetris_move(tetris, 0, 1);
-                break;
-            case 'w':
-                rotate(tetris);
-                break;
-            case ' ':
-                while (tetris_move(tetris, 0, 1)) {}
-                lockTetromino(tetris);
-		removeFullLines(tetris);
-		spawnTetromino(tetris); 
-                break;
-            case 'q':
-                tetris->gameOver = true;
-                break;
-            case 'p':
-                tetris->paused = !tetris->paused;
+/* Note the timing of the frame that was just presented */
+void recordFrame() {
+    uint64_t now = getCurrentTimeNanos();
+    int previous = (frameTimer.next + FRAME_HISTORY - 1) % FRAME_HISTORY;
+    FrameRecord record = {
+        .presentedAt = now,
+        .intervalMicros = frameTimer.count ? elapsedMicros(frameTimer.history[previous].presentedAt, now) : 0,
+        .renderMicros = elapsedMicros(frameTimer.frameStart, now),
+        .bytes = renderer.frameBytes,
+        .latencyMicros = elapsedMicros(frameTimer.pendingInput, now),
+    };
+    frameTimer.pendingInput = 0;
+
+    frameTimer.history[frameTimer.next] = record;
+    frameTimer.next = (frameTimer.next + 1) % FRAME_HISTORY;
+    if (frameTimer.count < FRAME_HISTORY) frameTimer.count++;
+
+    if (frameTimer.tracing) {
+        if (frameTimer.traceLength == frameTimer.traceCapacity) {
+            size_t capacity = frameTimer.traceCapacity ? frameTimer.traceCapacity * 2 : 4096;
+            FrameRecord *trace = realloc(frameTimer.trace, capacity * sizeof(FrameRecord));
+            if (!trace) {
+                frameTimer.tracing = false;
                 return;
-                break;
-            case 'g':
-                tetris->showGhost = !tetris->showGhost;
-                break;
-            case 'c':         
-                tetris->toggleColors = !tetris->toggleColors;
-                break;
-            case 't':  
-                tetris->showDots = !tetris->showDots;
-                break;
+            }
+            frameTimer.trace = trace;
+            frameTimer.traceCapacity = capacity;
         }
+        frameTimer.trace[frameTimer.traceLength++] = record;
     }
 }
 
-void update(Tetris *tetris) {
-    static uint64_t lastUpdateTimeMillis = 0;
-    uint64_t currentTimeMillis;
-    int speed = 1000 - (tetris->level - 1) * 100;
+static int compareMicros(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
 
-#ifdef _WIN32
-    LARGE_INTEGER frequency, currentTime;
-    QueryPerformanceFrequency(&frequency);
-    QueryPerformanceCounter(&currentTime);
-    currentTimeMillis = (currentTime.QuadPart * 1000) / frequency.QuadPart;
-#else
-    struct timespec tspec;
-    clock_gettime(CLOCK_MONOTONIC, &tspec);
-    currentTimeMillis = tspec.tv_sec * 1000 + tspec.tv_nsec / 1000000;
-#endif
+/* Percentile of one FrameRecord field over the recent history, skipping zeros */
+static double historyPercentile(size_t field, int percent) {
+    uint32_t values[FRAME_HISTORY];
+    int count = 0;
+    for (int i = 0; i < frameTimer.count; ++i) {
+        uint32_t value = *(const uint32_t *)((const char *)&frameTimer.history[i] + field);
+        if (value > 0) values[count++] = value;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    qsort(values, count, sizeof(uint32_t), compareMicros);
+    return values[(count - 1) * percent / 100] / 1000.0;
+}
 
-    if (currentTimeMillis - lastUpdateTimeMillis >= speed) {
-        if (!tetris_move(tetris, 0, 1)) {
-            lockTetromino(tetris);
-            removeFullLines(tetris);
-            spawnTetromino(tetris);
+/* The stats overlay shown next to the score with 'F' */
+void drawFrameStats(int row, int col) {
+    double fps = 0;
+    if (frameTimer.count > 1) {
+        int newest = (frameTimer.next + FRAME_HISTORY - 1) % FRAME_HISTORY;
+        int oldest = frameTimer.count < FRAME_HISTORY ? 0 : frameTimer.next;
+        uint64_t span = frameTimer.history[newest].presentedAt - frameTimer.history[oldest].presentedAt;
+        fps = span ? (frameTimer.count - 1) * 1e9 / span : 0;
+    }
+    uint64_t average = renderer.frames ? renderer.totalBytes / renderer.frames : 0;
 
-            if (!isValidPosition(tetris, tetris->currentPositions)) {
-                tetris->gameOver = true;
-            }
-        }
-        lastUpdateTimeMillis = currentTimeMillis;
-    } else {
-#ifdef _WIN32
-static uint64_t lastFrameTime = 0;
-uint64_t currentTime = getCurrentTimeMillis();
-uint64_t elapsedTime = currentTime - lastFrameTime;
-if (elapsedTime < 16) {
-    Sleep(16 - elapsedTime);
+    screenText(row, col, "FPS:     %.1f", fps);
+    screenText(row + 1, col, "Frame:   p50 %.2f  p99 %.2f ms",
+               historyPercentile(offsetof(FrameRecord, intervalMicros), 50),
+               historyPercentile(offsetof(FrameRecord, intervalMicros), 99));
+    screenText(row + 2, col, "Render:  p50 %.2f  p99 %.2f ms",
+               historyPercentile(offsetof(FrameRecord, renderMicros), 50),
+               historyPercentile(offsetof(FrameRecord, renderMicros), 99));
+    screenText(row + 3, col, "Bytes:   last %zu  avg %llu", renderer.lastFrameBytes, (unsigned long long)average);
+    screenText(row + 4, col, "Latency: p50 %.2f  p99 %.2f ms",
+               historyPercentile(offsetof(FrameRecord, latencyMicros), 50),
+               historyPercentile(offsetof(FrameRecord, latencyMicros), 99));
 }
-lastFrameTime = currentTime;
-#else
-        usleep(16000);
-#endif
+
+/* Dump every frame as CSV for offline analysis, runs at exit */
+void writeFrameTrace() {
+    if (!frameTimer.tracePath || frameTimer.traceLength == 0) {
+        return;
+    }
+    FILE *file = fopen(frameTimer.tracePath, "w");
+    if (!file) {
+        return;
     }
+    uint64_t start = frameTimer.trace[0].presentedAt;
+    fprintf(file, "frame,time_ms,interval_us,render_us,bytes,latency_us\n");
+    for (size_t i = 0; i < frameTimer.traceLength; ++i) {
+        const FrameRecord *record = &frameTimer.trace[i];
+        fprintf(file, "%zu,%.3f,%u,%u,%u,%u\n", i, (record->presentedAt - start) / 1e6,
+                record->intervalMicros, record->renderMicros, record->bytes, record->latencyMicros);
+    }
+    fclose(file);
 }
 
-bool tetris_move(Tetris *tetris, int dx, int dy) {
-    Point newPositions[4];
-    for (int i = 0; i < 4; ++i) {
-        newPositions[i] = (Point){tetris->currentPositions[i].x + dx, tetris->currentPositions[i].y + dy};
+/* Park the cursor below the last frame and give the terminal back */
+void leaveScreen() {
+    fflush(stdout);
+    frameAppend("\033[0m", 4);
+    frameCursorTo(renderer.rows - 1, 0);
+    frameAppend("\033[?25h", 6);
+    frameFlush();
+    renderer.fullRedraw = true;
+}
+
+/*
+  Terminals only send key presses, and repeat them while a key is held after
+  their own delay. That delay stands in for DAS. Once a second press comes in
+  quickly the key counts as held: the extra presses are dropped and
+  autoShift() moves the piece every ARR_TICKS instead. Shifts are counted in
+  ticks rather than presses, so a slow frame can't lose or bunch them.
+*/
+typedef struct {
+    int key;             // 'a' or 'd', 0 when nothing is held
+    bool held;
+    uint64_t lastPress;  // Tick of the last press the terminal sent
+    uint64_t nextShift;  // Tick of the next automatic shift
+} KeyRepeat;
+
+static KeyRepeat keyRepeat;
+
+/* Returns true when a shift key press is only the terminal repeating a held key */
+static bool repeatedShift(Tetris *tetris, int key) {
+    if (key != 'a' && key != 'd') {
+        return false;
     }
-    if (isValidPosition(tetris, newPositions)) {
-        for (int i = 0; i < 4; ++i) {
-            tetris->currentPositions[i] = newPositions[i];
+    if (key == keyRepeat.key && tetris->tick - keyRepeat.lastPress <= REPEAT_GAP_TICKS) {
+        if (!keyRepeat.held) {
+            keyRepeat.held = true;
+            keyRepeat.nextShift = tetris->tick;
         }
+        keyRepeat.lastPress = tetris->tick;
         return true;
     }
+    keyRepeat = (KeyRepeat){key, false, tetris->tick, 0};
     return false;
 }
 
-void rotatePoint(const Point *pivot, Point *point) {
-    int x = point->x - pivot->x;
-    int y = point->y - pivot->y;
-    point->x = pivot->x - y;
-    point->y = pivot->y + x;
+void input(Tetris *tetris) {
+    // Handle every key that is already waiting, not just one per frame
+    while (_kbhit()) {
+        int key = _getch();
+        if (key == EOF)
+          return;
+        if (frameTimer.pendingInput == 0)
+          frameTimer.pendingInput = getCurrentTimeNanos();
+        if (repeatedShift(tetris, key))
+          continue;
+        if (key == 'q' && !tetris->paused)
+          saveGame(tetris);
+        if (key == 'p' && versus.game)
+          continue; // The opponent can't pause too
+        recordKey(tetris, key);
+        applyKey(tetris, key);
+        if (key == 'p')
+          return;
+    }
+}
+
+void autoShift(Tetris *tetris) {
+    if (!keyRepeat.held) {
+        return;
+    }
+    if (tetris->paused || tetris->gameOver || tetris->tick - keyRepeat.lastPress > REPEAT_GAP_TICKS) {
+        keyRepeat = (KeyRepeat){0};  // Released
+        return;
+    }
+    while (keyRepeat.nextShift <= tetris->tick) {
+        recordKey(tetris, keyRepeat.key);
+        applyKey(tetris, keyRepeat.key);
+        keyRepeat.nextShift += ARR_TICKS;
+    }
+}
+
+/* Milliseconds until autoShift() has something to do, -1 if no key is held */
+int autoShiftDue(const Tetris *tetris) {
+    if (!keyRepeat.held) {
+        return -1;
+    }
+    uint64_t release = keyRepeat.lastPress + REPEAT_GAP_TICKS + 1;
+    uint64_t due = keyRepeat.nextShift < release ? keyRepeat.nextShift : release;
+    return ticksToMillis(&tetris->clock, due > tetris->tick ? due - tetris->tick : 0);
 }
 
-void rotate(Tetris *tetris) {
-    Point newPositions[4];
-    memcpy(newPositions, tetris->currentPositions, sizeof(Point) * 4);
-
-    int pivotIndex;
-    switch (tetris->currentTetromino) {
-        case I:
-        case J:
-        case L:
-        case T: 
-            pivotIndex = 1; 
+/* Apply one key press to the game, the same way in every mode */
+void applyKey(Tetris *tetris, int key) {
+    if(tetris->paused && key != 'p') // If game is paused and key pressed is not 'p', ignore it
+      return;
+    tetris->revision++;
+    switch (key) {
+        case 'a':
+            tetris_move(tetris, -1, 0);
+            break;
+        case 'd':
+            tetris_move(tetris, 1, 0);
+            break;
+        case 's':
+            tetris_move(tetris, 0, 1);
+            break;
+        case 'w':
+            rotate(tetris);
+            break;
+        case ' ':
+            // The ghost already knows where the piece lands
+            if (tetris->ghostDrop > 0) {
+                placePiece(tetris, tetris->rotation, tetris->position.x, tetris->position.y + tetris->ghostDrop);
+            }
+            dropPiece(tetris);
+            break;
+        case 'q':
+            tetris->gameOver = true;
+            break;
+        case 'p':
+            tetris->paused = !tetris->paused;
+            break;
+        case 'g':
+            tetris->showGhost = !tetris->showGhost;
             break;
-        case S:
-        case Z:
-            pivotIndex = 0;
+        case 'c':         
+            tetris->toggleColors = !tetris->toggleColors;
             break;
-        case O:
-            return; 
-        case INV_L: 
-            pivotIndex = 2; 
+        case 't':  
+            tetris->showDots = !tetris->showDots;
+            break;
+        case 'f':
+            tetris->showFrameStats = !tetris->showFrameStats;
+            break;
+        case 'h':
+            tetris->halfBlock = !tetris->halfBlock;
             break;
     }
+}
 
-    for (int i = 0; i < 4; ++i) {
-        if (i != pivotIndex) {
-            rotatePoint(&newPositions[pivotIndex], &newPositions[i]);
+/* Run the ticks that are due by the wall clock, returns milliseconds until the game next changes by itself */
+int update(Tetris *tetris) {
+    tetris_advance(tetris, clockTicks(&tetris->clock));
+    return ticksToMillis(&tetris->clock, ticksUntilEvent(tetris));
+}
+
+uint64_t clockTicks(GameClock *clock) {
+    uint64_t now = getCurrentTimeNanos();
+    if (clock->last == 0) {
+        clock->last = now;
+    }
+    clock->accumulator += now - clock->last;
+    clock->last = now;
+
+    uint64_t ticks = clock->accumulator / TICK_NANOS;
+    clock->accumulator -= ticks * TICK_NANOS;
+    return ticks < MAX_CATCHUP_TICKS ? ticks : MAX_CATCHUP_TICKS;
+}
+
+void clockReset(GameClock *clock) {
+    clock->last = getCurrentTimeNanos();
+    clock->accumulator = 0;
+}
+
+/* Milliseconds until some ticks from now, rounded up so a wakeup is never early */
+int ticksToMillis(const GameClock *clock, uint64_t ticks) {
+    uint64_t nanos = ticks * TICK_NANOS;
+    nanos = nanos > clock->accumulator ? nanos - clock->accumulator : 0;
+    uint64_t millis = (nanos + 999999) / 1000000;
+    return millis < 60000 ? (int)millis : 60000;
+}
+
+/* Start a new game whose pieces are fully determined by the seed */
+void tetris_init(Tetris *tetris, uint64_t seed, int width, int height, RandomizerPolicy policy, int previewDepth) {
+    memset(tetris, 0, sizeof(*tetris)); // Zeroed rows are an empty board
+    tetris->seed = seed;
+    tetris->width = width;
+    tetris->height = height;
+    tetris->fullRow = width == 64 ? ~(BoardRow)0 : ((BoardRow)1 << width) - 1;
+    tetris->level = 1;
+    tetris->showGhost = true;
+    tetris->toggleColors = true;
+    randomizerInit(&tetris->randomizer, seed, policy, previewDepth);
+    spawnTetromino(tetris);
+}
+
+uint32_t tetris_random(Tetris *tetris) {
+    return rngNext(&tetris->randomizer.rng);
+}
+
+/* The seed picks both the starting state and the stream */
+void rngSeed(Rng *rng, uint64_t seed) {
+    rng->state = 0;
+    rng->increment = (seed << 1) | 1;
+    rngNext(rng);
+    rng->state += seed;
+    rngNext(rng);
+}
+
+uint32_t rngNext(Rng *rng) {
+    uint64_t state = rng->state;
+    rng->state = state * 6364136223846793005ull + rng->increment;
+    uint32_t xorshifted = (uint32_t)(((state >> 18) ^ state) >> 27);
+    uint32_t rotation = state >> 59;
+    return (xorshifted >> rotation) | (xorshifted << ((32 - rotation) & 31));
+}
+
+/* A number below bound with no modulo bias, by multiplying and rejecting the uneven low end */
+uint32_t rngBelow(Rng *rng, uint32_t bound) {
+    uint64_t product = (uint64_t)rngNext(rng) * bound;
+    uint32_t low = (uint32_t)product;
+    if (low < bound) {
+        uint32_t threshold = (0u - bound) % bound;
+        while (low < threshold) {
+            product = (uint64_t)rngNext(rng) * bound;
+            low = (uint32_t)product;
         }
     }
+    return (uint32_t)(product >> 32);
+}
 
-    int offsetX[] = {0, 1, -1, 2, -2};
-    for (int i = 0; i < 5; ++i) {
-        bool valid = true;
-        for (int j = 0; j < 4; ++j) {
-            int x = newPositions[j].x + offsetX[i];
-            int y = newPositions[j].y;
-            if (x < 0 || x >= BOARD_WIDTH || y < 0 || y >= BOARD_HEIGHT || tetris->board[y][x] != '.') {
-                valid = false;
-                break;
+static Tetromino randomizerDraw(Randomizer *randomizer) {
+    switch (randomizer->policy) {
+        case RANDOMIZER_BAG7:
+        case RANDOMIZER_BAG8: {
+            if (randomizer->bagLeft == 0) {
+                randomizer->bagLeft = randomizer->policy == RANDOMIZER_BAG7 ? 7 : 8; // INV_L is last
+                for (int i = 0; i < randomizer->bagLeft; ++i) {
+                    randomizer->bag[i] = i;
+                }
+            }
+            // Take any piece still in the bag, which shuffles it one piece at a time
+            int pick = rngBelow(&randomizer->rng, randomizer->bagLeft);
+            Tetromino piece = randomizer->bag[pick];
+            randomizer->bag[pick] = randomizer->bag[--randomizer->bagLeft];
+            return piece;
+        }
+        case RANDOMIZER_HISTORY: {
+            Tetromino piece = I;
+            bool recent = true;
+            for (int roll = 0; roll < HISTORY_ROLLS && recent; ++roll) {
+                piece = rngBelow(&randomizer->rng, 8);
+                recent = false;
+                for (int i = 0; i < HISTORY_LENGTH; ++i) {
+                    recent |= randomizer->history[i] == piece;
+                }
             }
+            memmove(&randomizer->history[1], &randomizer->history[0], (HISTORY_LENGTH - 1) * sizeof(Tetromino));
+            randomizer->history[0] = piece;
+            return piece;
         }
-        if (valid) {
-            for (int j = 0; j < 4; ++j) {
-                tetris->currentPositions[j].x = newPositions[j].x + offsetX[i];
-                tetris->currentPositions[j].y = newPositions[j].y;
+        default:
+            return rngBelow(&randomizer->rng, 8);
+    }
+}
+
+void randomizerInit(Randomizer *randomizer, uint64_t seed, RandomizerPolicy policy, int previewDepth) {
+    *randomizer = (Randomizer){.policy = policy, .previewDepth = previewDepth,
+                               .history = {Z, S, Z, S}}; // Keeps the awkward pieces from opening the game
+    rngSeed(&randomizer->rng, seed);
+    for (int i = 0; i < previewDepth; ++i) {
+        randomizer->preview[i] = randomizerDraw(randomizer);
+    }
+}
+
+/* Deal the next piece and queue up a new one behind the preview */
+Tetromino randomizerTake(Randomizer *randomizer) {
+    Tetromino piece = randomizer->preview[randomizer->previewStart];
+    randomizer->preview[randomizer->previewStart] = randomizerDraw(randomizer);
+    randomizer->previewStart = (randomizer->previewStart + 1) % randomizer->previewDepth;
+    return piece;
+}
+
+/* The piece coming after index others, 0 is the next one */
+Tetromino randomizerPeek(const Randomizer *randomizer, int index) {
+    return randomizer->preview[(randomizer->previewStart + index) % randomizer->previewDepth];
+}
+
+uint32_t gravityPerTick(int level) {
+    int count = sizeof(GRAVITY) / sizeof(GRAVITY[0]);
+    return GRAVITY[level < 1 ? 0 : level > count ? count - 1 : level - 1];
+}
+
+/* Ticks until gravity moves the piece or the lock delay runs out, whichever it is waiting on */
+uint64_t ticksUntilEvent(const Tetris *tetris) {
+    if (tetris->ghostDrop == 0) {
+        return LOCK_DELAY_TICKS - tetris->lockTimer;
+    }
+    uint32_t gravity = gravityPerTick(tetris->level);
+    return (0x10000 - tetris->gravityFraction + gravity - 1) / gravity;
+}
+
+void tetris_tick(Tetris *tetris) {
+    tetris_advance(tetris, 1);
+}
+
+/*
+  Run a number of ticks with no input. Nothing happens between one gravity
+  row or lock and the next, so it jumps straight from one to the next.
+*/
+void tetris_advance(Tetris *tetris, uint64_t ticks) {
+    while (ticks > 0 && !tetris->gameOver && !tetris->paused) {
+        uint64_t untilEvent = ticksUntilEvent(tetris);
+        uint64_t step = ticks < untilEvent ? ticks : untilEvent;
+        tetris->tick += step;
+        ticks -= step;
+
+        if (tetris->ghostDrop == 0) {
+            // Resting on the stack, gravity has nothing to do until it locks
+            tetris->gravityFraction = 0;
+            tetris->lockTimer += step;
+            if (tetris->lockTimer >= LOCK_DELAY_TICKS) {
+                dropPiece(tetris);
             }
+            continue;
+        }
+
+        // Fast levels pull several rows in one tick, but never through the stack
+        uint64_t fraction = tetris->gravityFraction + step * gravityPerTick(tetris->level);
+        uint64_t rows = fraction >> 16;
+        tetris->gravityFraction = fraction & 0xffff;
+        if (rows > 0) {
+            int drop = rows < (uint64_t)tetris->ghostDrop ? (int)rows : tetris->ghostDrop;
+            placePiece(tetris, tetris->rotation, tetris->position.x, tetris->position.y + drop);
+        }
+    }
+}
+
+/* Lock the landed piece, clear lines and bring in the next one */
+void dropPiece(Tetris *tetris) {
+    lockTetromino(tetris);
+    removeFullLines(tetris);
+    if (tetris->incomingCount > 0) {
+        riseGarbage(tetris);
+    }
+    spawnTetromino(tetris);
+
+    if (!isValidPosition(tetris, tetris->currentPositions)) {
+        tetris->gameOver = true;
+    }
+}
+
+bool tetris_move(Tetris *tetris, int dx, int dy) {
+    int x = tetris->position.x + dx;
+    int y = tetris->position.y + dy;
+    if (pieceFits(tetris, tetris->currentTetromino, tetris->rotation, x, y)) {
+        placePiece(tetris, tetris->rotation, x, y);
+        return true;
+    }
+    return false;
+}
+
+void rotate(Tetris *tetris) {
+    int rotation = (tetris->rotation + 1) % 4;
+
+    for (int i = 0; i < 5; ++i) {
+        int x = tetris->position.x + ROTATION_KICKS[i];
+        if (pieceFits(tetris, tetris->currentTetromino, rotation, x, tetris->position.y)) {
+            placePiece(tetris, rotation, x, tetris->position.y);
             break;
         }
     }
 }
 
+/* Move the falling piece to a rotation and origin; the caller checks it fits */
+void placePiece(Tetris *tetris, int rotation, int x, int y) {
+    // Reaching a new low restarts the lock delay, other moves only a limited number of times
+    if (y > tetris->lowestY) {
+        tetris->lowestY = y;
+        tetris->lockTimer = 0;
+        tetris->lockResets = 0;
+    } else if (tetris->lockTimer > 0 && tetris->lockResets < LOCK_RESETS) {
+        tetris->lockTimer = 0;
+        tetris->lockResets++;
+    }
+    tetris->revision++;
+    tetris->rotation = rotation;
+    tetris->position = (Point){x, y};
+    for (int i = 0; i < 4; ++i) {
+        const Point *cell = &PIECE_CELLS[tetris->currentTetromino][rotation][i];
+        tetris->currentPositions[i] = (Point){x + cell->x, y + cell->y};
+    }
+    updateGhost(tetris);
+}
+
+bool pieceFits(const Tetris *tetris, Tetromino piece, int rotation, int x, int y) {
+    return rowsFit(tetris->rows, tetris->width, tetris->height, piece, rotation, x, y);
+}
+
+/* Test a whole piece against a bitboard, one row mask at a time */
+bool rowsFit(const BoardRow *rows, int width, int height, Tetromino piece, int rotation, int x, int y) {
+    const PieceMask *mask = &PIECE_MASKS[piece][rotation];
+    int left = x + mask->left;
+    int top = y + mask->top;
+    if (left < 0 || left + mask->width > width || top < 0 || top + mask->height > height) {
+        return false;
+    }
+    for (int row = 0; row < mask->height; ++row) {
+        if (rows[top + row] & ((BoardRow)mask->rows[row] << left)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 bool isValidPosition(const Tetris *tetris, const Point *positions) {
     for (int i = 0; i < 4; ++i) {
         int x = positions[i].x;
         int y = positions[i].y;
-        if (x < 0 || x >= BOARD_WIDTH || y < 0 || y >= BOARD_HEIGHT) {
+        if (x < 0 || x >= tetris->width || y < 0 || y >= tetris->height) {
             return false;
         }
-        if (tetris->board[y][x] != '.') {
+        if (tetris->rows[y] & ((BoardRow)1 << x)) {
             return false;
         }
     }
@@ -858,38 +5680,125 @@ bool isValidPosition(const Tetris *tetris, const Point *positions) {
 }
 
 void lockTetromino(Tetris *tetris) {
+    int growth = 0, filled = 0;
+    tetris->lockTop = tetris->height;
+    tetris->lockBottom = -1;
     for (int i = 0; i < 4; ++i) {
-        int value = tetris->toggleColors ? tetris->currentTetromino : -tetris->currentTetromino;
-        tetris->board[tetris->currentPositions[i].y][tetris->currentPositions[i].x] = value;
+        int x = tetris->currentPositions[i].x;
+        int y = tetris->currentPositions[i].y;
+        if (x < 0 || x >= tetris->width || y < 0 || y >= tetris->height) {
+            continue; // Never happens for a piece placed by the rules, see fuzzCheckState()
+        }
+        filled += !(tetris->rows[y] & ((BoardRow)1 << x)); // A piece dropped after game over can overlap
+        tetris->rows[y] |= (BoardRow)1 << x;
+        tetris->colors[y][x] = tetris->currentTetromino;
+
+        int height = tetris->height - y;
+        if (height > tetris->columnHeights[x]) {
+            growth += height - tetris->columnHeights[x];
+            tetris->columnHeights[x] = height;
+        }
+        if (y < tetris->lockTop) tetris->lockTop = y;
+        if (y > tetris->lockBottom) tetris->lockBottom = y;
     }
+    // Holes are the cells under the column tops that aren't filled
+    tetris->holes += growth - filled;
+    tetris->pieces++;
+    tetris->revision++;
+    updateGhost(tetris);
 }
 
-int _kbhit() {
-#ifdef _WIN32
-    return kbhit();
-#else
-    struct termios oldt, newt;
-    int ch;
-    int oldf;
+/* Garbage waits until the next piece locks, so it never lands under a falling piece */
+void queueGarbage(Tetris *tetris, int rows, int hole) {
+    if (rows <= 0 || hole < 0 || hole >= tetris->width) {
+        return;
+    }
+    if (tetris->incomingCount == GARBAGE_QUEUE_MAX) {
+        // Out of room, the last batch grows instead
+        Garbage *last = &tetris->incoming[GARBAGE_QUEUE_MAX - 1];
+        last->rows = last->rows + rows > tetris->height ? tetris->height : last->rows + rows;
+        return;
+    }
+    tetris->incoming[tetris->incomingCount++] = (Garbage){rows > tetris->height ? tetris->height : rows, hole};
+    tetris->revision++;
+}
 
-    tcgetattr(STDIN_FILENO, &oldt);
-    newt = oldt;
-    newt.c_lflag &= ~(ICANON | ECHO);
-    tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-    oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
+/* Push the stack up by the queued garbage, blocks pushed off the top end the game */
+void riseGarbage(Tetris *tetris) {
+    for (int i = 0; i < tetris->incomingCount; ++i) {
+        int rows = tetris->incoming[i].rows;
+        for (int y = 0; y < rows; ++y) {
+            if (tetris->rows[y]) {
+                tetris->gameOver = true;
+            }
+        }
+        memmove(&tetris->rows[0], &tetris->rows[rows], (tetris->height - rows) * sizeof(BoardRow));
+        memmove(tetris->colors[0], tetris->colors[rows], (tetris->height - rows) * sizeof(tetris->colors[0]));
+        for (int y = tetris->height - rows; y < tetris->height; ++y) {
+            tetris->rows[y] = tetris->fullRow & ~((BoardRow)1 << tetris->incoming[i].hole);
+            memset(tetris->colors[y], GARBAGE_COLOR_INDEX, sizeof(tetris->colors[y]));
+        }
+    }
+    tetris->incomingCount = 0;
+    recountBoard(tetris);
+}
+
+/* Work out the column heights and holes from scratch, after the rows were set some other way */
+void recountBoard(Tetris *tetris) {
+    BoardRow covered = 0;
+    tetris->holes = 0;
+    memset(tetris->columnHeights, 0, sizeof(tetris->columnHeights));
+    for (int y = 0; y < tetris->height; ++y) {
+        for (int x = 0; x < tetris->width; ++x) {
+            BoardRow bit = (BoardRow)1 << x;
+            if ((tetris->rows[y] & bit) && !(covered & bit)) {
+                tetris->columnHeights[x] = tetris->height - y;
+            } else if (!(tetris->rows[y] & bit) && (covered & bit)) {
+                tetris->holes++;
+            }
+        }
+        covered |= tetris->rows[y];
+    }
+    tetris->lockTop = 0;
+    tetris->lockBottom = tetris->height - 1;
+    updateGhost(tetris);
+}
 
-    ch = getchar();
+/* Cache how far the current piece can drop, so frames don't have to work it out */
+void updateGhost(Tetris *tetris) {
+    // Above the stack, the piece lands where its cells first meet a column top
+    int drop = tetris->height;
+    for (int i = 0; i < 4; ++i) {
+        const Point *cell = &tetris->currentPositions[i];
+        int gap = tetris->height - tetris->columnHeights[cell->x] - 1 - cell->y;
+        if (gap < drop) drop = gap;
+    }
+    if (drop >= 0) {
+        tetris->ghostDrop = drop;
+        return;
+    }
 
-    tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-    fcntl(STDIN_FILENO, F_SETFL, oldf);
+    // Tucked under an overhang, search down row by row
+    Tetromino piece = tetris->currentTetromino;
+    int x = tetris->position.x;
+    int y = tetris->position.y;
 
-    if (ch != EOF) {
-        ungetc(ch, stdin);
-        return 1;
+    tetris->ghostDrop = -1;
+    while (pieceFits(tetris, piece, tetris->rotation, x, y + tetris->ghostDrop + 1)) {
+        tetris->ghostDrop++;
     }
+}
 
-    return 0;
+#ifndef _WIN32
+static bool inputClosed = false; // stdin hit end of file, stop polling it
+#endif
+
+int _kbhit() {
+#ifdef _WIN32
+    return kbhit();
+#else
+    struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+    return !inputClosed && poll(&fd, 1, 0) > 0;
 #endif
 }
 
@@ -897,14 +5806,35 @@ int _getch() {
 #ifdef _WIN32
     return getch();
 #else
-    struct termios oldt, newt;
-    int ch;
-    tcgetattr(STDIN_FILENO, &oldt);
-    newt = oldt;
-    newt.c_lflag &= ~(ICANON | ECHO);
-    tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-    ch = getchar();
-    tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+    unsigned char ch;
+    ssize_t count;
+    do {
+        count = read(STDIN_FILENO, &ch, 1);
+    } while (count < 0 && errno == EINTR);
+    if (count <= 0) {
+        inputClosed = true;
+        return EOF;
+    }
     return ch;
 #endif
 }
+
+/* Block until a key is ready or the timeout runs out, -1 waits forever */
+bool waitForInput(int timeoutMillis) {
+#ifdef _WIN32
+    DWORD woken = WaitForSingleObject(GetStdHandle(STD_INPUT_HANDLE), timeoutMillis < 0 ? INFINITE : (DWORD)timeoutMillis);
+    checkConsoleResized();
+    return woken == WAIT_OBJECT_0 && _kbhit();
+#else
+    // Viewers are served from here too, so a game sleeping on a key still takes them in
+    struct pollfd fds[2 + SPECTATE_MAX_VIEWERS] = {{inputClosed ? -1 : STDIN_FILENO, POLLIN, 0}};
+    int count = 1 + spectatePollFds(fds + 1);
+    if (poll(fds, count, timeoutMillis) <= 0) {
+        return false;
+    }
+    if (count > 1) {
+        spectateService(fds + 1, count - 1);
+    }
+    return fds[0].revents != 0;
+#endif
+}